@@ -30,12 +30,25 @@
  */
 
 #include <Python.h>
+#include <structmember.h>
 #include <unicodeobject.h>
+#include <datetime.h>
 #include <netinet/in.h>
+#include <unistd.h>
+#include <time.h>
 #if defined(__linux__)
 	#include <byteswap.h>
 	#include <endian.h>
 #endif
+#if defined(__SSSE3__)
+	#include <tmmintrin.h>
+#elif defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+	#include <nmmintrin.h>
+	#define CRC32C_SSE42 1	/* used if the cpu supports it */
+#endif
 
 PyDoc_STRVAR(wbin_module_documentation,
 	     "Provide encoding and decoding functions for a speed/CPU "
@@ -48,6 +61,103 @@ PyDoc_STRVAR(wbin_module_documentation,
 #define INIT_BUFFER_LEN   0x1000
 #define DEFAULT_MAX_DEPTH 0x1000
 #define DEFAULT_MAX_RUN   0x8000
+#define DEFAULT_HIGH_WATER 0x10000
+#define DEFAULT_STEP_BUDGET 0x10000
+#define STEP_CLOCK_SLICE   0x4000
+#define DEFAULT_KEY_CACHE  0x400
+#define KEY_CACHE_MAX_LEN  64
+
+/*
+ * shared key vocabulary. dict keys found in a loaded table are written
+ * as their index and decoded to the table's interned string, anything
+ * else is written inline. both peers must load the same version of the
+ * table, messages using it carry that version in their header.
+ */
+struct symbol_table {
+	uint32_t  version;
+	PyObject *names;	/* tuple of interned str, by index */
+	PyObject *index;	/* str -> index */
+};
+
+/*
+ * encoding/decoding options. the module level functions use a single
+ * global set, Codec objects each carry their own.
+ */
+struct wbin_options {
+	int utf8;
+	int wls;
+	int max_depth;
+	int indexed;
+	int key_cache;
+	int cache_values;
+	int version;
+	int little_endian;
+	int packed;
+	int ndarray;
+	int extended;
+	int refs;
+	int schemas;
+	int compress;
+	int checksum;
+	struct symbol_table *symbols;	/* owned by the Codec/Decoder/Encoder */
+};
+
+/*
+ * decoded string cache. a bounded, direct mapped table from the raw
+ * bytes of short strings to string objects, consulted before anything
+ * is allocated. dict keys are interned when first cached.
+ */
+struct key_cache {
+	PyObject **slots;
+	int        mask;
+};
+
+/*
+ * back references. while encoding, strings of at least REF_MIN_LEN
+ * bytes are indexed by content and containers by identity; a value
+ * seen before is written as the index of its first occurrence. the
+ * decoder indexes the same values in the same order. list, dict and
+ * set are indexed before their contents, so that they may contain
+ * themselves, tuple and frozenset after.
+ */
+#define REF_MIN_LEN 4
+
+struct ref_slot {
+	PyObject *key;
+	int       index;
+};
+
+struct ref_table {
+	struct ref_slot *slots;		/* encode, objects by identity */
+	int              mask;
+	int              used;
+	PyObject        *strings;	/* encode, str by content */
+	PyObject        *unicodes;	/* encode, unicode by content */
+	PyObject       **objects;	/* decode, values by index */
+	int              room;
+	int              count;		/* values indexed so far */
+};
+
+/*
+ * reusable encode buffer, sized adaptively to recent output.
+ */
+struct scratch_buffer {
+	char *buf;
+	int   len;
+	int   min;
+	int   avg;
+	int   busy;
+};
+
+/*
+ * destination of a streaming encode, either a file descriptor or the
+ * write method of a file like object.
+ */
+struct stream_sink {
+	PyObject     *write;
+	int           fd;
+	PY_LONG_LONG  total;
+};
 
 struct serial_buffer {
 	/*
@@ -63,6 +173,41 @@ struct serial_buffer {
 	PyObject *args;
 	int       size;
 	int       last;
+	/*
+	 * stepped operation. the engine hands control back once the offset
+	 * reaches stop (0 for never); with a deadline stop only marks when
+	 * the clock is next read, limit is the end of the byte budget.
+	 */
+	int    stop;
+	int    limit;
+	double deadline;
+	/*
+	 * encode buffer may not be grown (caller supplied/exact size)
+	 */
+	int fixed;
+	/*
+	 * streaming output, buffer is flushed rather than grown
+	 */
+	struct stream_sink *sink;
+	/*
+	 * options in effect for this operation, and the format flags of
+	 * the message being encoded/decoded.
+	 */
+	struct wbin_options *opts;
+	int format;
+	/*
+	 * decoded string cache
+	 */
+	struct key_cache *keys;
+	/*
+	 * object exporting the decode buffer, if any. decoded ndarrays
+	 * refer into it rather than copy when it is a string.
+	 */
+	PyObject *owner;
+	/*
+	 * back reference table, for messages using them.
+	 */
+	struct ref_table *refs;
 };
 
 #define TYPE_NULL   0x0
@@ -76,6 +221,112 @@ struct serial_buffer {
 #define TYPE_TUPLE  0x9
 #define TYPE_LONGER 0xA
 #define TYPE_PICKLE 0xB
+#define TYPE_ARRAY  0xC
+#define TYPE_NDARRAY 0xD
+#define TYPE_EXT    0xE
+#define TYPE_BOOL   0xF
+#define TYPE_SET    0x10
+#define TYPE_FROZENSET 0x11
+#define TYPE_DATETIME  0x12	/* microseconds since the epoch */
+#define TYPE_DECIMAL   0x13	/* as its string representation */
+#define TYPE_REF       0x14	/* index of an earlier value */
+#define TYPE_SYMBOL    0x15	/* index into the symbol table */
+#define TYPE_RECORD    0x16	/* schema id and check, then the values */
+
+/*
+ * packed arrays. a list or tuple of plain ints, or of floats, is
+ * written as its element count, a kind byte and one block of fixed
+ * width values.
+ */
+#define ARRAY_INT32  0x1
+#define ARRAY_INT64  0x2
+#define ARRAY_DOUBLE 0x3
+#define ARRAY_TUPLE  0x80	/* decodes as a tuple */
+
+#define ARRAY_MIN    4		/* shorter lists are never packed */
+#define ARRAY_CHUNK  256	/* values byte swapped per decode step */
+
+/*
+ * optional format header. plain payloads always begin with a zero
+ * byte (the high byte of a type tag), a payload using any format
+ * extension, or the compact encoding, begins with the magic byte
+ * followed by the format version and flags. decoders predating the
+ * header reject such a payload as an unhandled type before decoding
+ * anything.
+ */
+#define FORMAT_MAGIC      0xB1
+#define FORMAT_VERSION    0x1
+#define FORMAT_COMPACT_VERSION 0x2
+#define FORMAT_HEADER_LEN 3
+
+#define FORMAT_INDEXED 0x01	/* containers carry their encoded length */
+#define FORMAT_LE      0x02	/* fixed width fields are little endian */
+#define FORMAT_REFS    0x04	/* values may refer back to earlier ones */
+#define FORMAT_SYMBOLS 0x08	/* dict keys may be symbols, see below */
+#define FORMAT_LZ      0x10	/* body is compressed, see below */
+#define FORMAT_CRC     0x20	/* message is checksummed, see below */
+#define FORMAT_TYPES   0x40	/* body may use the types added since */
+
+#define FORMAT_FLAGS (FORMAT_INDEXED | FORMAT_LE | FORMAT_REFS | \
+		      FORMAT_SYMBOLS | FORMAT_LZ | FORMAT_CRC | FORMAT_TYPES)
+/*
+ * a payload using symbols follows the flags with the u32 version of
+ * the symbol table it was encoded with. a checksummed payload then has
+ * the u32 length of the rest of the message and its u32 CRC32C, which
+ * covers the whole message but the checksum itself. a compressed
+ * payload then has the u32 lengths of the body and of its compressed
+ * form, which makes up the rest of the message.
+ */
+#define FORMAT_SYMBOLS_LEN 4
+#define FORMAT_CRC_LEN     8
+#define FORMAT_LZ_LEN      8
+#define FORMAT_HEADER_MAX  (FORMAT_HEADER_LEN + FORMAT_SYMBOLS_LEN + \
+			    FORMAT_CRC_LEN + FORMAT_LZ_LEN)
+
+#define FORMAT_COMPACT 0x100	/* version 2 payload, not a wire flag */
+/*
+ * compact (version 2) encoding. every value begins with a single tag
+ * byte, small ints and short lengths/counts are carried in the tag
+ * itself and anything larger follows it as a varint. ints are zigzag
+ * encoded, floats which survive the round trip are sent as float32.
+ * fixed width fields are big endian.
+ */
+#define COMPACT_FIXINT    0x00	/* 0x00 - 0x7f, ints 0 to 127 */
+#define COMPACT_STRING    0x80	/* 0x80 - 0x9f, up to 31 bytes */
+#define COMPACT_LIST      0xa0	/* 0xa0 - 0xaf, up to 15 elements */
+#define COMPACT_DICT      0xb0	/* 0xb0 - 0xbf, up to 15 items */
+#define COMPACT_NULL      0xc0
+#define COMPACT_INT       0xc1	/* zigzag varint */
+#define COMPACT_LONGER    0xc2
+#define COMPACT_FLOAT     0xc3
+#define COMPACT_DOUBLE    0xc4
+#define COMPACT_STRING_N  0xc5
+#define COMPACT_UTF8_N    0xc6
+#define COMPACT_LIST_N    0xc7
+#define COMPACT_DICT_N    0xc8
+#define COMPACT_TUPLE_N   0xc9
+#define COMPACT_PICKLE    0xca
+#define COMPACT_ARRAY     0xcb
+#define COMPACT_NDARRAY   0xcc
+#define COMPACT_EXT       0xcd
+#define COMPACT_FALSE     0xce
+#define COMPACT_TRUE      0xcf
+#define COMPACT_UTF8      0xd0	/* 0xd0 - 0xdf, up to 15 bytes */
+#define COMPACT_SET_N     0xe0
+#define COMPACT_FROZENSET_N 0xe1
+#define COMPACT_DATETIME  0xe2	/* zigzag varint */
+#define COMPACT_DECIMAL   0xe3
+#define COMPACT_REF       0xe4
+#define COMPACT_SYMBOL    0xe5
+#define COMPACT_RECORD    0xe6
+#define COMPACT_NEGINT    0xf0	/* 0xf0 - 0xff, ints -16 to -1 */
+
+#define COMPACT_VARINT_MAX 10
+/*
+ * indexed lists and tuples of at least this many elements also carry
+ * an element offset table.
+ */
+#define INDEX_TABLE_MIN 64
 
 #define TYPE_CMD 666
 #define TYPE_RESPONSE 667
@@ -94,835 +345,9160 @@ struct serial_buffer {
 	#include <libkern/OSByteOrder.h>
 	#define htonll(x) OSSwapHostToBigInt64(x)
 	#define ntohll(x) OSSwapBigToHostInt64(x)
+	#define bswap_32(x) OSSwapInt32(x)
+	#define bswap_64(x) OSSwapInt64(x)
 #endif
 
-#if PY_MAJOR_VERSION == 2 && PY_MINOR_VERSION == 4
-typedef int Py_ssize_t ;
+#if defined(__linux__)
+	#define htoles(x)  htole16(x)
+	#define htolel(x)  htole32(x)
+	#define htolell(x) htole64(x)
+	#define letohs(x)  le16toh(x)
+	#define letohl(x)  le32toh(x)
+	#define letohll(x) le64toh(x)
+#endif
+#if defined(__APPLE__)
+	#define htoles(x)  OSSwapHostToLittleInt16(x)
+	#define htolel(x)  OSSwapHostToLittleInt32(x)
+	#define htolell(x) OSSwapHostToLittleInt64(x)
+	#define letohs(x)  OSSwapLittleToHostInt16(x)
+	#define letohl(x)  OSSwapLittleToHostInt32(x)
+	#define letohll(x) OSSwapLittleToHostInt64(x)
 #endif
 
-static PyObject *cpickle_str;
-static PyObject *cploads_str;
-static PyObject *cpdumps_str;
-static PyObject *empty_tuple;
+/*
+ * fixed width fields are big endian, or little endian in payloads
+ * flagged FORMAT_LE, where a little endian host then swaps nothing.
+ * plain doubles are in host order unless flagged.
+ */
+static inline uint16_t _load_u16(const char *p, int format)
+{
+	uint16_t value = *(uint16_t *)p;
 
-static PyObject *cpick  = NULL;
-static int utf8_support = 1;
-static int wls_on = 1;
-static int max_depth    = DEFAULT_MAX_DEPTH;
+	return (format & FORMAT_LE) ? letohs(value) : ntohs(value);
+}
 
-struct whitelist_entry {
-	PyObject *mod;
-	PyObject *cls;
-	char     *mname;
-	char     *cname;
-};
+static inline uint32_t _load_u32(const char *p, int format)
+{
+	uint32_t value = *(uint32_t *)p;
 
-static struct whitelist_entry whitelist[] = {
-	{NULL, NULL, "decimal", "Decimal"},
-	{NULL, NULL, NULL, NULL}
-};
+	return (format & FORMAT_LE) ? letohl(value) : ntohl(value);
+}
 
-static int _check_space(struct serial_buffer *buffer, int space)
+static inline uint64_t _load_u64(const char *p, int format)
 {
-	if ((buffer->len - buffer->off) < space) {
-		PyErr_Format(PyExc_SystemError,
-			     "insufficient data <%d> at <%d> of <%d>",
-			     space, buffer->off, buffer->len);
-		return -EINVAL;
-	}
+	uint64_t value = *(uint64_t *)p;
 
-	return 0;
+	return (format & FORMAT_LE) ? letohll(value) : ntohll(value);
 }
 
-#ifdef USED_SOMEWHERE
-static int _check_encode(char *str, int size)
+static inline double _load_double(const char *p, int format)
 {
-	int i;
-
-	for (i = 0; i < size/4; i++)
-		if (0x80808080 & ((unsigned int *)str)[i])
-			return 1;
+	uint64_t bits;
+	double value;
 
-	for (i *= 4; i < size; i++)
-		if (0x80 & str[i])
-			return 1;
+	if (!(format & FORMAT_LE))
+		return *(double *)p;
 
-	return 0;
+	bits = letohll(*(uint64_t *)p);
+	memcpy(&value, &bits, sizeof(value));
+	return value;
 }
-#endif
 
-static int _check_yield(struct serial_buffer *b)
+static inline void _store_u16(char *p, uint16_t value, int format)
 {
-	PyObject *result = NULL;
-	PyObject *args;
-	int i = 0;
-
-	if ((b->off - b->last) < b->size)
-		return 0;
-	/*
-	 * allocate call argument tuple of size N + 1. Where N
-	 * is the size of the user supplied tuple, the extra slot
-	 * contains the current offset as feedback for the user.
-	 */
-	args = PyTuple_New(PyTuple_GET_SIZE(b->args) + 1);
-	/*
-	 * Place the current offset into slot 0, the single reference
-	 * to the new integer object will be decremented when the arg
-	 * tuple is dereferenced and deallocated.
-	 */
-	PyTuple_SET_ITEM(args, i++, PyInt_FromLong(b->off));
-	/*
-	 * Link the objects in the user supplied arguments tuple into
-	 * the new tuple. Do not incremenet the reference count since
-	 * after the call we NULL out the entries w/o a decrement.
-	 */
-	for (; i < PyTuple_GET_SIZE(args); i++)
-		PyTuple_SET_ITEM(args, i, PyTuple_GET_ITEM(b->args, i-1));
-	/*
-	 * call user supplied callback
-	 */
-	result = PyObject_Call(b->func, args, NULL);
-	/*
-	 * NULL out the entries for the user supplied arguments, and
-	 * derefernce the local arguments tuple.
-	 */
-	for (i = 1; i < PyTuple_GET_SIZE(args); i++)
-		PyTuple_SET_ITEM(args, i, NULL);
+	*(uint16_t *)p = (format & FORMAT_LE) ? htoles(value) : htons(value);
+}
 
-	Py_DECREF(args);
-	/*
-	 * process result
-	 */
-	if (!result)
-		return -EINVAL;
+static inline void _store_u32(char *p, uint32_t value, int format)
+{
+	*(uint32_t *)p = (format & FORMAT_LE) ? htolel(value) : htonl(value);
+}
 
-	Py_DECREF(result);
-	b->last = b->off;
-	return 0;
+static inline void _store_u64(char *p, uint64_t value, int format)
+{
+	*(uint64_t *)p = (format & FORMAT_LE) ? htolell(value) : htonll(value);
 }
 
-static void _deserialize_error(struct serial_buffer *b)
+static inline void _store_double(char *p, double value, int format)
 {
-	/*
-	 * check if the current error is a memory error and include
-	 * information about our buffer.
-	 */
-	if (PyErr_Occurred() != PyExc_MemoryError)
+	uint64_t bits;
+
+	if (!(format & FORMAT_LE)) {
+		*(double *)p = value;
 		return;
+	}
 
-	PyErr_Format(PyExc_MemoryError,
-		     "allocation failure. length <%d> offset <%d>",
-		     b->len, b->off);
-	return;
-}		       
+	memcpy(&bits, &value, sizeof(bits));
+	*(uint64_t *)p = htolell(bits);
+}
 
-static int _get_size(struct serial_buffer *b)
+/*
+ * whether fixed width fields of the given format are byte swapped
+ * relative to the host.
+ */
+static inline int _swapped(int format)
 {
-	int size;
-
-	if (_check_space(b, sizeof(uint32_t))) {
-		PyErr_Format(PyExc_MemoryError, 
-			     "no size available at <%d> of <%d>",
-			     b->off, b->len);
-		return -1;
-	}
+	if (format & FORMAT_LE)
+		return htolel(1) != 1;
 
-	size = ntohl(*(uint32_t *)(b->buf + b->off));
-	b->off += sizeof(uint32_t);
+	return htonl(1) != 1;
+}
 
-	if (size > (b->len - b->off)) {
-		PyErr_Format(PyExc_MemoryError,
-			     "Unreasonable element size <%d> at offset <%ld>",
-			     size, b->off - sizeof(uint32_t));
-		return -1;
+/*
+ * copy count values from src to dst, reversing the byte order of
+ * each. src and dst may be the same.
+ */
+static void _swap_u32(char *dst, const char *src, int count)
+{
+	int i = 0;
+#if defined(__SSSE3__)
+	const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+					  4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i v;
+
+	for (; i + 4 <= count; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		v = _mm_shuffle_epi8(v, mask);
+		_mm_storeu_si128((__m128i *)(dst + i * 4), v);
 	}
-
-	return size;
+#elif defined(__SSE2__)
+	__m128i v;
+
+	for (; i + 4 <= count; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		v = _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), v);
+	}
+#endif
+	for (; i < count; i++)
+		((uint32_t *)dst)[i] = bswap_32(((const uint32_t *)src)[i]);
 }
 
-static PyObject *_deserialize_object(struct serial_buffer *b)
+static void _swap_u64(char *dst, const char *src, int count)
 {
-	PyObject *output = NULL;
-	PyObject *loads;
-	PyObject *value;
-	int result = 0;
-	int size;
+	int i = 0;
+#if defined(__SSSE3__)
+	const __m128i mask = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15,
+					  0, 1, 2, 3, 4, 5, 6, 7);
+	__m128i v;
+
+	for (; i + 2 <= count; i += 2) {
+		v = _mm_loadu_si128((const __m128i *)(src + i * 8));
+		v = _mm_shuffle_epi8(v, mask);
+		_mm_storeu_si128((__m128i *)(dst + i * 8), v);
+	}
+#elif defined(__SSE2__)
+	__m128i v;
+
+	for (; i + 2 <= count; i += 2) {
+		v = _mm_loadu_si128((const __m128i *)(src + i * 8));
+		v = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + i * 8), v);
+	}
+#endif
+	for (; i < count; i++)
+		((uint64_t *)dst)[i] = bswap_64(((const uint64_t *)src)[i]);
+}
 
-	size = _get_size(b);
-	if (0 > size)
-		goto err_load;
+static inline int _array_width(int kind)
+{
+	switch (kind & ~ARRAY_TUPLE) {
+	case ARRAY_INT32:
+		return sizeof(int32_t);
+	case ARRAY_INT64:
+		return sizeof(int64_t);
+	case ARRAY_DOUBLE:
+		return sizeof(double);
+	default:
+		return 0;
+	}
+}
 
-	result = _check_space(b, size);
-	if (result)
-		goto err_load;
+#if PY_MAJOR_VERSION == 2 && PY_MINOR_VERSION == 4
+typedef int Py_ssize_t ;
+#endif
 
-	loads = PyObject_GetAttr(cpick, cploads_str);
-	if (!loads)
-		goto err_load;
+/*
+ * unicode transcoding. Text is mostly ASCII, so runs of ASCII are
+ * located and converted sixteen code units at a time; anything else
+ * is handled one character at a time with the same rules as the
+ * builtin UTF-8 codec, so that output and errors are unchanged.
+ */
+static Py_ssize_t _ascii_bytes(const unsigned char *s, Py_ssize_t size)
+{
+	Py_ssize_t i = 0;
+#if defined(__SSE2__)
+	__m128i v;
 
-	value = PyString_FromStringAndSize((b->buf + b->off), size);
-	if (!value)
-		goto err_data;
+	for (; i + 16 <= size; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(v))
+			break;
+	}
+#endif
+	for (; i < size; i++)
+		if (s[i] & 0x80)
+			break;
 
-	b->off += size;
+	return i;
+}
 
-	output = PyObject_CallFunction(loads, "O", value);
+static Py_ssize_t _ascii_units(const Py_UNICODE *u, Py_ssize_t size)
+{
+	Py_ssize_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; i + 16 <= size; i += 16) {
+#if Py_UNICODE_SIZE == 4
+		v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(u + i)),
+				     _mm_loadu_si128((const __m128i *)(u + i + 4))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *)(u + i + 8)),
+				     _mm_loadu_si128((const __m128i *)(u + i + 12))));
+		v = _mm_and_si128(v, _mm_set1_epi32(~0x7f));
+#else
+		v = _mm_or_si128(_mm_loadu_si128((const __m128i *)(u + i)),
+				 _mm_loadu_si128((const __m128i *)(u + i + 8)));
+		v = _mm_and_si128(v, _mm_set1_epi16(~0x7f));
+#endif
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			break;
+	}
+#endif
+	for (; i < size; i++)
+		if ((Py_UCS4)u[i] & ~0x7f)
+			break;
 
-	Py_DECREF(value);
-err_data:
-	Py_DECREF(loads);
-err_load:
-	return output;
+	return i;
 }
 
-static PyObject *_deserialize(struct serial_buffer *b, int intern)
+static void _narrow_ascii(char *dst, const Py_UNICODE *src, Py_ssize_t size)
 {
-	PyObject *output = NULL;
-	PyObject *value;
-	PyObject *key;
-	char error_str[128];
-	int result;
-	int type;
-	int size;
-	int i;
-
-	if (!b) {
-		PyErr_SetString(PyExc_SystemError, "missing buffer object");
-		return NULL;
+	Py_ssize_t i = 0;
+#if defined(__SSE2__)
+	__m128i lo, hi;
+
+	for (; i + 16 <= size; i += 16) {
+#if Py_UNICODE_SIZE == 4
+		lo = _mm_packs_epi32(
+			_mm_loadu_si128((const __m128i *)(src + i)),
+			_mm_loadu_si128((const __m128i *)(src + i + 4)));
+		hi = _mm_packs_epi32(
+			_mm_loadu_si128((const __m128i *)(src + i + 8)),
+			_mm_loadu_si128((const __m128i *)(src + i + 12)));
+#else
+		lo = _mm_loadu_si128((const __m128i *)(src + i));
+		hi = _mm_loadu_si128((const __m128i *)(src + i + 8));
+#endif
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packus_epi16(lo, hi));
 	}
-
+#endif
+	for (; i < size; i++)
+		dst[i] = (char)src[i];
+}
+
+static void _widen_ascii
+(
+	Py_UNICODE *dst,
+	const unsigned char *src,
+	Py_ssize_t size
+)
+{
+	Py_ssize_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+
+	for (; i + 16 <= size; i += 16) {
+		v  = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+#if Py_UNICODE_SIZE == 4
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 4),
+				 _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8),
+				 _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 12),
+				 _mm_unpackhi_epi16(hi, zero));
+#else
+		_mm_storeu_si128((__m128i *)(dst + i), lo);
+		_mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+#endif
+	}
+#endif
+	for (; i < size; i++)
+		dst[i] = src[i];
+}
+
+/*
+ * the builtin codec joins a surrogate pair into one character even on
+ * wide builds.
+ */
+static inline int _surrogate_pair(const Py_UNICODE *u, Py_ssize_t i,
+				  Py_ssize_t size)
+{
+	return (u[i] >= 0xd800 && u[i] <= 0xdbff && i + 1 < size &&
+		u[i + 1] >= 0xdc00 && u[i + 1] <= 0xdfff);
+}
+
+/*
+ * encoded UTF-8 length of a unicode buffer
+ */
+static Py_ssize_t _utf8_len(const Py_UNICODE *u, Py_ssize_t size)
+{
+	Py_ssize_t length;
+	Py_ssize_t i;
+	Py_UCS4 ch;
+
+	for (i = length = 0; i < size; i++) {
+		ch = u[i];
+
+		if (!(ch & ~0x7f)) {
+			Py_ssize_t run = _ascii_units(u + i, size - i);
+
+			length += run;
+			i += run;
+			if (i == size)
+				break;
+
+			ch = u[i];
+		}
+
+		if (ch < 0x800)
+			length += 2;
+		else if (_surrogate_pair(u, i, size)) {
+			length += 4;
+			i++;
+		}
+		else if (ch < 0x10000)
+			length += 3;
+		else
+			length += 4;
+	}
+
+	return length;
+}
+
+/*
+ * encode a unicode buffer as UTF-8 into dst, which must have room for
+ * _utf8_len() bytes.
+ */
+static void _utf8_encode(char *dst, const Py_UNICODE *u, Py_ssize_t size)
+{
+	Py_UCS4 ch;
+	Py_ssize_t i;
+
+	for (i = 0; i < size; i++) {
+		ch = u[i];
+
+		if (!(ch & ~0x7f)) {
+			Py_ssize_t run = _ascii_units(u + i, size - i);
+
+			_narrow_ascii(dst, u + i, run);
+			dst += run;
+			i += run;
+			if (i == size)
+				break;
+
+			ch = u[i];
+		}
+
+		if (ch < 0x800) {
+			*dst++ = (char)(0xc0 | (ch >> 6));
+			*dst++ = (char)(0x80 | (ch & 0x3f));
+			continue;
+		}
+		if (_surrogate_pair(u, i, size)) {
+			ch = 0x10000 + (((ch - 0xd800) << 10) |
+					(u[++i] - 0xdc00));
+		}
+		if (ch < 0x10000) {
+			*dst++ = (char)(0xe0 | (ch >> 12));
+			*dst++ = (char)(0x80 | ((ch >> 6) & 0x3f));
+			*dst++ = (char)(0x80 | (ch & 0x3f));
+			continue;
+		}
+
+		*dst++ = (char)(0xf0 | (ch >> 18));
+		*dst++ = (char)(0x80 | ((ch >> 12) & 0x3f));
+		*dst++ = (char)(0x80 | ((ch >> 6) & 0x3f));
+		*dst++ = (char)(0x80 | (ch & 0x3f));
+	}
+}
+
+/*
+ * decode UTF-8. Sequences are accepted exactly as the builtin codec
+ * accepts them (including encoded surrogates); on anything it would
+ * reject, it is called instead to raise the usual UnicodeDecodeError.
+ */
+static PyObject *_utf8_decode(const char *input, Py_ssize_t size)
+{
+	const unsigned char *s = (const unsigned char *)input;
+	const unsigned char *e = s + size;
+	PyObject *output;
+	Py_UNICODE *p;
+	Py_UCS4 ch;
+	Py_ssize_t run;
+
+	run = _ascii_bytes(s, size);
+
+	output = PyUnicode_FromUnicode(NULL, size);
+	if (!output)
+		return NULL;
+
+	p = PyUnicode_AS_UNICODE(output);
+	_widen_ascii(p, s, run);
+	if (run == size)
+		return output;
+
+	p += run;
+	s += run;
+
+	while (s < e) {
+		ch = *s;
+
+		if (ch < 0x80) {
+			run = _ascii_bytes(s, e - s);
+			_widen_ascii(p, s, run);
+			p += run;
+			s += run;
+			continue;
+		}
+
+		if (ch >= 0xc2 && ch <= 0xdf) {
+			if (e - s < 2 || (s[1] & 0xc0) != 0x80)
+				goto fallback;
+
+			*p++ = ((ch & 0x1f) << 6) | (s[1] & 0x3f);
+			s += 2;
+			continue;
+		}
+
+		if (ch >= 0xe0 && ch <= 0xef) {
+			if (e - s < 3 ||
+			    (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
+			    (ch == 0xe0 && s[1] < 0xa0))
+				goto fallback;
+
+			*p++ = ((ch & 0x0f) << 12) | ((s[1] & 0x3f) << 6) |
+				(s[2] & 0x3f);
+			s += 3;
+			continue;
+		}
+
+		if (ch >= 0xf0 && ch <= 0xf4) {
+			if (e - s < 4 ||
+			    (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
+			    (s[3] & 0xc0) != 0x80 ||
+			    (ch == 0xf0 && s[1] < 0x90) ||
+			    (ch == 0xf4 && s[1] > 0x8f))
+				goto fallback;
+
+			ch = ((ch & 0x07) << 18) | ((s[1] & 0x3f) << 12) |
+				((s[2] & 0x3f) << 6) | (s[3] & 0x3f);
+#ifdef Py_UNICODE_WIDE
+			*p++ = ch;
+#else
+			ch -= 0x10000;
+			*p++ = 0xd800 | (ch >> 10);
+			*p++ = 0xdc00 | (ch & 0x3ff);
+#endif
+			s += 4;
+			continue;
+		}
+
+		goto fallback;
+	}
+
+	if (PyUnicode_Resize(&output, p - PyUnicode_AS_UNICODE(output)) < 0) {
+		Py_XDECREF(output);
+		return NULL;
+	}
+
+	return output;
+fallback:
+	Py_DECREF(output);
+	return PyUnicode_DecodeUTF8(input, size, "strict");
+}
+
+static PyObject *cpickle_str;
+static PyObject *cploads_str;
+static PyObject *cpdumps_str;
+static PyObject *empty_tuple;
+
+static PyObject *cpick  = NULL;
+static PyObject *cploads = NULL;
+static PyObject *cpdumps = NULL;
+static PyObject *decimal_type = NULL;
+static PyObject *numpy  = NULL;
+static PyObject *ndarray_type = NULL;
+
+static struct wbin_options default_options = {
+	1,			/* utf8 */
+	1,			/* wls */
+	DEFAULT_MAX_DEPTH,	/* max_depth */
+	0,			/* indexed */
+	DEFAULT_KEY_CACHE,	/* key_cache */
+	0,			/* cache_values */
+	FORMAT_VERSION,		/* version */
+	0,			/* little_endian */
+	0,			/* packed */
+	0,			/* ndarray */
+	0,			/* extended */
+	0,			/* refs */
+	0,			/* schemas */
+	0,			/* compress */
+	0,			/* checksum */
+	NULL,			/* symbols */
+};
+
+static struct key_cache default_keys;
+
+struct whitelist_entry {
+	PyObject *mod;
+	PyObject *cls;
+	char     *mname;
+	char     *cname;
+};
+
+static struct whitelist_entry whitelist[] = {
+	{NULL, NULL, "decimal", "Decimal"},
+	{NULL, NULL, NULL, NULL}
+};
+
+/*
+ * extension types. an instance of a registered class is encoded as its
+ * tag followed by whatever its encoder returns, encoded natively, and
+ * decoded by passing that value to the decoder registered for the tag.
+ * registered classes bypass the whitelist and pickle altogether.
+ */
+#define EXT_TAG_MAX 0xff
+
+struct ext_entry {
+	PyObject *cls;
+	PyObject *encode;
+	PyObject *decode;
+};
+
+static struct ext_entry ext_types[EXT_TAG_MAX + 1];
+static PyObject *ext_classes;	/* class -> tag */
+
+/*
+ * record schemas. a dict whose keys are exactly the fields of a
+ * registered schema, and whose values are of the expected types if
+ * any were given, is encoded as the schema id followed by the values
+ * in field order. it decodes to a dict built from the interned field
+ * names, or to cls(*values) if a class was registered with it.
+ *
+ * the record argument carries a check of the schema's field names
+ * above the id. a peer with the id registered to other fields refuses
+ * the record, rather than assign its values to the wrong fields.
+ *
+ * dicts are matched by a signature, the sum of their key hashes, which
+ * indexes a small open addressed table of schema ids. the order keys
+ * were last seen in is kept, dicts built alike then match w/o any
+ * lookups.
+ */
+#define SCHEMA_ID_MAX 0xff
+#define SCHEMA_SLOTS  (2 * (SCHEMA_ID_MAX + 1))
+#define SCHEMA_CHECK_SHIFT 8
+#define SCHEMA_CHECK_MAX   0xffff
+
+struct schema_entry {
+	PyObject *fields;	/* tuple of interned str */
+	PyObject *types;	/* tuple of types or None, or NULL */
+	PyObject *cls;
+	PyObject *index;	/* field -> position */
+	int      *order;	/* position of each key, as last seen */
+	uint64_t  sign;
+	uint32_t  check;	/* of the field names, in order */
+};
+
+static struct schema_entry schemas[SCHEMA_ID_MAX + 1];
+static int schema_slots[SCHEMA_SLOTS];	/* schema id + 1, 0 if empty */
+static int schema_count;
+
+static int _check_space(struct serial_buffer *buffer, int space)
+{
+	if ((buffer->len - buffer->off) < space) {
+		PyErr_Format(PyExc_SystemError,
+			     "insufficient data <%d> at <%d> of <%d>",
+			     space, buffer->off, buffer->len);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * acquire a view onto a buffer protocol object. new style buffers
+ * (bytearray, memoryview, str) are tried first, then the old style
+ * read/write buffer interface (mmap, array).
+ */
+static int _get_buffer(PyObject *input, Py_buffer *view, int writable)
+{
+	int result;
+
+	if (PyObject_CheckBuffer(input))
+		return PyObject_GetBuffer(input, view,
+					  writable ? PyBUF_WRITABLE :
+					  PyBUF_SIMPLE);
+
+	memset(view, 0, sizeof(*view));
+
+	if (writable)
+		result = PyObject_AsWriteBuffer(input, &view->buf, &view->len);
+	else
+		result = PyObject_AsReadBuffer(input,
+					       (const void **)&view->buf,
+					       &view->len);
+	return result;
+}
+
+#ifdef USED_SOMEWHERE
+static int _check_encode(char *str, int size)
+{
+	int i;
+
+	for (i = 0; i < size/4; i++)
+		if (0x80808080 & ((unsigned int *)str)[i])
+			return 1;
+
+	for (i *= 4; i < size; i++)
+		if (0x80 & str[i])
+			return 1;
+
+	return 0;
+}
+#endif
+
+static int _check_yield(struct serial_buffer *b)
+{
+	PyObject *result = NULL;
+	PyObject *args;
+	int i = 0;
+
+	if ((b->off - b->last) < b->size)
+		return 0;
+	/*
+	 * allocate call argument tuple of size N + 1. Where N
+	 * is the size of the user supplied tuple, the extra slot
+	 * contains the current offset as feedback for the user.
+	 */
+	args = PyTuple_New(PyTuple_GET_SIZE(b->args) + 1);
+	/*
+	 * Place the current offset into slot 0, the single reference
+	 * to the new integer object will be decremented when the arg
+	 * tuple is dereferenced and deallocated.
+	 */
+	PyTuple_SET_ITEM(args, i++, PyInt_FromLong(b->off));
+	/*
+	 * Link the objects in the user supplied arguments tuple into
+	 * the new tuple. Do not incremenet the reference count since
+	 * after the call we NULL out the entries w/o a decrement.
+	 */
+	for (; i < PyTuple_GET_SIZE(args); i++)
+		PyTuple_SET_ITEM(args, i, PyTuple_GET_ITEM(b->args, i-1));
+	/*
+	 * call user supplied callback
+	 */
+	result = PyObject_Call(b->func, args, NULL);
+	/*
+	 * NULL out the entries for the user supplied arguments, and
+	 * derefernce the local arguments tuple.
+	 */
+	for (i = 1; i < PyTuple_GET_SIZE(args); i++)
+		PyTuple_SET_ITEM(args, i, NULL);
+
+	Py_DECREF(args);
+	/*
+	 * process result
+	 */
+	if (!result)
+		return -EINVAL;
+
+	Py_DECREF(result);
+	b->last = b->off;
+	return 0;
+}
+
+static double _step_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/*
+ * start a step of a suspendable operation, with a budget of bytes (0
+ * for unbounded) and of seconds (0 for unbounded).
+ */
+static void _step_begin(struct serial_buffer *b, int budget, double seconds)
+{
+	b->limit = INT_MAX;
+	if (0 < budget && budget < (INT_MAX - b->off))
+		b->limit = b->off + budget;
+
+	b->deadline = 0;
+	b->stop     = b->limit;
+
+	if (0 < seconds) {
+		b->deadline = _step_clock() + seconds;
+		if ((b->limit - b->off) > STEP_CLOCK_SLICE)
+			b->stop = b->off + STEP_CLOCK_SLICE;
+	}
+}
+
+/*
+ * the engine reached the stop offset. returns 1 once the step is over,
+ * otherwise moves stop on by another clock slice.
+ */
+static int _step_expired(struct serial_buffer *b)
+{
+	if (b->off >= b->limit || !b->deadline)
+		return 1;
+
+	if (_step_clock() >= b->deadline)
+		return 1;
+
+	b->stop = b->limit;
+	if ((b->limit - b->off) > STEP_CLOCK_SLICE)
+		b->stop = b->off + STEP_CLOCK_SLICE;
+
+	return 0;
+}
+
+static void _deserialize_error(struct serial_buffer *b)
+{
+	/*
+	 * check if the current error is a memory error and include
+	 * information about our buffer.
+	 */
+	if (PyErr_Occurred() != PyExc_MemoryError)
+		return;
+
+	PyErr_Format(PyExc_MemoryError,
+		     "allocation failure. length <%d> offset <%d>",
+		     b->len, b->off);
+	return;
+}		       
+
+static int _get_size(struct serial_buffer *b)
+{
+	int size;
+
+	if (_check_space(b, sizeof(uint32_t))) {
+		PyErr_Format(PyExc_MemoryError, 
+			     "no size available at <%d> of <%d>",
+			     b->off, b->len);
+		return -1;
+	}
+
+	size = _load_u32(b->buf + b->off, b->format);
+	b->off += sizeof(uint32_t);
+
+	if (size > (b->len - b->off)) {
+		PyErr_Format(PyExc_MemoryError,
+			     "Unreasonable element size <%d> at offset <%ld>",
+			     size, b->off - sizeof(uint32_t));
+		return -1;
+	}
+
+	return size;
+}
+
+/*
+ * parse an optional format header. returns the header length (0 for
+ * a plain payload), -EAGAIN if more data is needed to tell, or another
+ * negative value with an exception set.
+ */
+static int _get_header(const char *buf, int len, int *format)
+{
+	int size;
+
+	*format = 0;
+
+	if (len < 1)
+		return -EAGAIN;
+
+	if ((unsigned char)buf[0] != FORMAT_MAGIC)
+		return 0;
+
+	if (len < FORMAT_HEADER_LEN)
+		return -EAGAIN;
+
+	if (buf[1] != FORMAT_VERSION && buf[1] != FORMAT_COMPACT_VERSION) {
+		PyErr_Format(PyExc_TypeError,
+			     "Unsupported format version: <%d>",
+			     (unsigned char)buf[1]);
+		return -EINVAL;
+	}
+
+	if (buf[2] & ~FORMAT_FLAGS) {
+		PyErr_Format(PyExc_TypeError,
+			     "Unsupported format flags: <0x%x>",
+			     (unsigned char)buf[2]);
+		return -EINVAL;
+	}
+
+	*format = (unsigned char)buf[2];
+	if (buf[1] == FORMAT_COMPACT_VERSION)
+		*format |= FORMAT_COMPACT;
+
+	size = FORMAT_HEADER_LEN;
+	if (*format & FORMAT_SYMBOLS)
+		size += FORMAT_SYMBOLS_LEN;
+	if (*format & FORMAT_CRC)
+		size += FORMAT_CRC_LEN;
+	if (*format & FORMAT_LZ)
+		size += FORMAT_LZ_LEN;
+
+	if (len < size)
+		return -EAGAIN;
+
+	return size;
+}
+
+/*
+ * a payload using symbols can only be decoded with the version of the
+ * table it was encoded with.
+ */
+static int _check_symbols
+(
+	struct symbol_table *t,
+	const char *header,
+	int format
+)
+{
+	uint32_t version;
+
+	if (!(format & FORMAT_SYMBOLS))
+		return 0;
+
+	version = _load_u32(header + FORMAT_HEADER_LEN, format);
+	if (!t) {
+		PyErr_Format(PyExc_ValueError,
+			     "Symbol table <%u> not loaded", version);
+		return -EINVAL;
+	}
+
+	if (t->version != version) {
+		PyErr_Format(PyExc_ValueError,
+			     "Symbol table version mismatch <%u> (loaded <%u>)",
+			     version, t->version);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * block compression, in the LZ4 block format. a sequence is a token
+ * byte holding the literal count and the match length less LZ_MIN_MATCH
+ * (4 bits each, 15 continuing in further bytes of up to 255), the
+ * literals, and the match as a u16 little endian distance back into
+ * the output and the match length continuation. the last sequence is
+ * literals only. neither direction touches any python object, they
+ * run w/o the GIL.
+ */
+#define LZ_HASH_BITS   12
+#define LZ_MIN_MATCH   4
+#define LZ_LAST_LITERALS 5	/* a block always ends with literals */
+#define LZ_MATCH_LIMIT 12	/* no match starts closer to the end */
+#define LZ_MAX_DISTANCE 0xffff
+#define LZ_SKIP_SHIFT  6	/* search faster through incompressible data */
+
+static inline uint32_t _lz_load(const unsigned char *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t _lz_hash(uint32_t value)
+{
+	return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline unsigned char *_lz_put_len(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+
+	*op++ = len;
+	return op;
+}
+
+static inline long long _lz_bound(int size)
+{
+	return (long long)size + size / 255 + 16;
+}
+
+/*
+ * compress size bytes of src into dst, which must hold _lz_bound(size)
+ * bytes. returns the compressed length.
+ */
+static int _lz_compress(const char *src, int size, char *dst)
+{
+	const unsigned char *in     = (const unsigned char *)src;
+	const unsigned char *end    = in + size;
+	const unsigned char *limit  = in + MAX(size - LZ_MATCH_LIMIT, 0);
+	const unsigned char *anchor = in;
+	const unsigned char *ip     = in;
+	const unsigned char *ref;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *token;
+	int table[1 << LZ_HASH_BITS];
+	uint32_t value;
+	size_t len;
+	int h;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip < limit) {
+		value = _lz_load(ip);
+		h     = _lz_hash(value);
+		ref   = in + table[h];
+
+		table[h] = ip - in;
+
+		if (ref >= ip || ip - ref > LZ_MAX_DISTANCE ||
+		    _lz_load(ref) != value) {
+			ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		for (len = LZ_MIN_MATCH;
+		     ip + len < end - LZ_LAST_LITERALS && ip[len] == ref[len];
+		     len++);
+
+		token = op++;
+
+		*token = MIN(ip - anchor, 15) << 4;
+		if (ip - anchor >= 15)
+			op = _lz_put_len(op, ip - anchor - 15);
+
+		memcpy(op, anchor, ip - anchor);
+		op += ip - anchor;
+
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+
+		*token |= MIN(len - LZ_MIN_MATCH, 15);
+		if (len - LZ_MIN_MATCH >= 15)
+			op = _lz_put_len(op, len - LZ_MIN_MATCH - 15);
+
+		ip    += len;
+		anchor = ip;
+	}
+
+	token = op++;
+
+	*token = MIN(end - anchor, 15) << 4;
+	if (end - anchor >= 15)
+		op = _lz_put_len(op, end - anchor - 15);
+
+	memcpy(op, anchor, end - anchor);
+	op += end - anchor;
+
+	return op - (unsigned char *)dst;
+}
+
+/*
+ * decompress size bytes of src into dst, of room bytes. returns the
+ * decompressed length, or -EINVAL if the data is malformed.
+ */
+static int _lz_decompress(const char *src, int size, char *dst, int room)
+{
+	const unsigned char *ip  = (const unsigned char *)src;
+	const unsigned char *end = ip + size;
+	const unsigned char *ref;
+	unsigned char *op   = (unsigned char *)dst;
+	unsigned char *oend = op + room;
+	size_t distance;
+	size_t len;
+	int token;
+	int more;
+
+	for (;;) {
+		if (ip >= end)
+			return -EINVAL;
+
+		token = *ip++;
+
+		len = token >> 4;
+		for (more = (len == 15); more && ip < end; ) {
+			more = (*ip == 255);
+			len += *ip++;
+			if (len > (size_t)size)
+				return -EINVAL;
+		}
+
+		if (more || len > (size_t)(end - ip) ||
+		    len > (size_t)(oend - op))
+			return -EINVAL;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -EINVAL;
+
+		distance = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (!distance || distance > (size_t)(op - (unsigned char *)dst))
+			return -EINVAL;
+
+		len = token & 15;
+		for (more = (len == 15); more && ip < end; ) {
+			more = (*ip == 255);
+			len += *ip++;
+			if (len > (size_t)room)
+				return -EINVAL;
+		}
+
+		len += LZ_MIN_MATCH;
+		if (more || len > (size_t)(oend - op))
+			return -EINVAL;
+
+		ref = op - distance;
+		if (distance >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else
+			while (len--)
+				*op++ = *ref++;
+	}
+
+	return op - (unsigned char *)dst;
+}
+
+/*
+ * CRC32C (Castagnoli). computed with the SSE4.2 crc32 instruction when
+ * the cpu has it, otherwise eight bytes at a time from a set of tables
+ * built at module load.
+ */
+#define CRC32C_POLY 0x82f63b78	/* reflected */
+
+static uint32_t crc32c_table[8][256];
+#if defined(CRC32C_SSE42)
+static int      crc32c_hw;
+#endif
+
+static void _crc32c_init(void)
+{
+	uint32_t crc;
+	int i;
+	int k;
+
+	for (i = 0; i < 256; i++) {
+		for (crc = i, k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+
+		crc32c_table[0][i] = crc;
+	}
+
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+#if defined(CRC32C_SSE42)
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t _crc32c_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo;
+	uint32_t hi;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+
+		crc = crc32c_table[7][lo & 0xff] ^
+		      crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xff] ^
+		      crc32c_table[2][(hi >> 8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^
+		      crc32c_table[0][hi >> 24];
+	}
+
+	for (; len; len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#if defined(CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t value;
+	uint64_t word;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	for (value = crc; len >= 8; len -= 8, p += 8) {
+		memcpy(&word, p, sizeof(word));
+		value = _mm_crc32_u64(value, word);
+	}
+
+	for (crc = value; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/*
+ * crc of buf continuing from that of the data preceding it, 0 to
+ * start.
+ */
+static uint32_t _crc32c(uint32_t crc, const char *buf, size_t len)
+{
+#if defined(CRC32C_SSE42)
+	if (crc32c_hw)
+		return ~_crc32c_sse42(~crc, (const unsigned char *)buf, len);
+#endif
+	return ~_crc32c_table(~crc, (const unsigned char *)buf, len);
+}
+
+/*
+ * check of a schema's field names, over their count and each name in
+ * order. str hashes are not stable across processes, crc32c is.
+ */
+static uint32_t _schema_check(PyObject *fields)
+{
+	Py_ssize_t count = PyTuple_GET_SIZE(fields);
+	uint32_t crc = count;
+	PyObject *name;
+	Py_ssize_t i;
+
+	for (i = 0; i < count; i++) {
+		name = PyTuple_GET_ITEM(fields, i);
+		crc  = _crc32c(crc, PyString_AS_STRING(name),
+			       PyString_GET_SIZE(name) + 1);
+	}
+
+	return (crc ^ (crc >> 16)) & SCHEMA_CHECK_MAX;
+}
+
+/*
+ * registered schema a record argument refers to, which must have the
+ * fields the record was encoded with.
+ */
+static struct schema_entry *_schema_get(long long arg)
+{
+	int id = arg & SCHEMA_ID_MAX;
+
+	if (0 > arg || (arg >> SCHEMA_CHECK_SHIFT) > SCHEMA_CHECK_MAX ||
+	    !schemas[id].fields) {
+		PyErr_Format(PyExc_TypeError, "Unregistered schema: <%d>", id);
+		return NULL;
+	}
+
+	if (schemas[id].check != (arg >> SCHEMA_CHECK_SHIFT)) {
+		PyErr_Format(PyExc_ValueError,
+			     "Schema <%d> fields differ from the encoder's", id);
+		return NULL;
+	}
+
+	return &schemas[id];
+}
+
+/*
+ * registered schema whose class input is an instance of, NULL if there
+ * is none.
+ */
+static struct schema_entry *_schema_instance(PyObject *input)
+{
+	int i;
+
+	if (!schema_count)
+		return NULL;
+
+	for (i = 0; i <= SCHEMA_ID_MAX; i++)
+		if (schemas[i].cls == (PyObject *)Py_TYPE(input))
+			return &schemas[i];
+
+	return NULL;
+}
+
+/*
+ * verify the checksum of a framed message, buf holding len bytes from
+ * its start, before anything in it is decoded. once verified the frame
+ * is dropped from the format and the body decodes as any other. with
+ * required set unframed messages are rejected, a flipped flag bit would
+ * otherwise go unnoticed.
+ */
+static int _check_frame(const char *buf, int len, int *format, int required)
+{
+	const char *frame;
+	uint32_t value;
+	uint32_t size;
+	uint32_t crc;
+
+	if (!(*format & FORMAT_CRC) && required) {
+		PyErr_SetString(PyExc_ValueError, "Checksum missing");
+		return -EINVAL;
+	}
+
+	if (!(*format & FORMAT_CRC))
+		return 0;
+
+	frame = buf + FORMAT_HEADER_LEN;
+	if (*format & FORMAT_SYMBOLS)
+		frame += FORMAT_SYMBOLS_LEN;
+
+	size = _load_u32(frame, *format);
+	crc  = _load_u32(frame + sizeof(uint32_t), *format);
+
+	if (size > len - (frame + FORMAT_CRC_LEN - buf)) {
+		PyErr_Format(PyExc_SystemError,
+			     "insufficient data <%u> at <%d> of <%d>", size,
+			     (int)(frame + FORMAT_CRC_LEN - buf), len);
+		return -EINVAL;
+	}
+
+	value = _crc32c(0, buf, frame + sizeof(uint32_t) - buf);
+	value = _crc32c(value, frame + FORMAT_CRC_LEN, size);
+	if (value != crc) {
+		PyErr_Format(PyExc_ValueError,
+			     "Checksum mismatch <0x%x> (computed <0x%x>)",
+			     crc, value);
+		return -EINVAL;
+	}
+
+	*format &= ~FORMAT_CRC;
+	return 0;
+}
+
+/*
+ * compact payloads. returns the varint length, 0 if more data is
+ * needed, or a negative value with an exception set.
+ */
+static int _get_varint(const char *buf, int len, uint64_t *value)
+{
+	uint64_t output = 0;
+	int i;
+
+	for (i = 0; i < COMPACT_VARINT_MAX; i++) {
+		if (i >= len)
+			return 0;
+
+		output |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+		if (!(buf[i] & 0x80)) {
+			*value = output;
+			return i + 1;
+		}
+	}
+
+	PyErr_SetString(PyExc_SystemError, "malformed varint");
+	return -EINVAL;
+}
+
+/*
+ * parse the tag, and any varint following it, of a compact value.
+ * arg receives the value of an int, the length of a string, the
+ * element count of a container, or the width of a float. returns the
+ * length parsed, 0 if more data is needed, or a negative value with
+ * an exception set.
+ */
+static int _get_tag(const char *buf, int len, int *type, long long *arg)
+{
+	uint64_t value;
+	int size;
+	int tag;
+
+	if (len < 1)
+		return 0;
+
+	tag  = (unsigned char)buf[0];
+	*arg = 0;
+
+	if (tag < COMPACT_STRING) {
+		*type = TYPE_INT;
+		*arg  = tag;
+		return 1;
+	}
+
+	if (tag >= COMPACT_NEGINT) {
+		*type = TYPE_INT;
+		*arg  = tag - 0x100;
+		return 1;
+	}
+
+	switch (tag & 0xf0) {
+	case COMPACT_STRING:
+	case COMPACT_STRING + 0x10:
+		*type = TYPE_STRING;
+		*arg  = tag & 0x1f;
+		return 1;
+	case COMPACT_LIST:
+		*type = TYPE_LIST;
+		*arg  = tag & 0x0f;
+		return 1;
+	case COMPACT_DICT:
+		*type = TYPE_DICT;
+		*arg  = tag & 0x0f;
+		return 1;
+	case COMPACT_UTF8:
+		*type = TYPE_UTF8;
+		*arg  = tag & 0x0f;
+		return 1;
+	}
+
+	switch (tag) {
+	case COMPACT_NULL:
+		*type = TYPE_NULL;
+		return 1;
+	case COMPACT_FLOAT:
+		*type = TYPE_DOUBLE;
+		*arg  = sizeof(float);
+		return 1;
+	case COMPACT_DOUBLE:
+		*type = TYPE_DOUBLE;
+		*arg  = sizeof(double);
+		return 1;
+	case COMPACT_FALSE:
+	case COMPACT_TRUE:
+		*type = TYPE_BOOL;
+		*arg  = tag == COMPACT_TRUE;
+		return 1;
+	case COMPACT_INT:
+		*type = TYPE_LONG;
+		break;
+	case COMPACT_LONGER:
+		*type = TYPE_LONGER;
+		break;
+	case COMPACT_STRING_N:
+		*type = TYPE_STRING;
+		break;
+	case COMPACT_UTF8_N:
+		*type = TYPE_UTF8;
+		break;
+	case COMPACT_LIST_N:
+		*type = TYPE_LIST;
+		break;
+	case COMPACT_DICT_N:
+		*type = TYPE_DICT;
+		break;
+	case COMPACT_TUPLE_N:
+		*type = TYPE_TUPLE;
+		break;
+	case COMPACT_PICKLE:
+		*type = TYPE_PICKLE;
+		break;
+	case COMPACT_ARRAY:
+		*type = TYPE_ARRAY;
+		break;
+	case COMPACT_NDARRAY:
+		*type = TYPE_NDARRAY;
+		break;
+	case COMPACT_EXT:
+		*type = TYPE_EXT;
+		break;
+	case COMPACT_SET_N:
+		*type = TYPE_SET;
+		break;
+	case COMPACT_FROZENSET_N:
+		*type = TYPE_FROZENSET;
+		break;
+	case COMPACT_DATETIME:
+		*type = TYPE_DATETIME;
+		break;
+	case COMPACT_DECIMAL:
+		*type = TYPE_DECIMAL;
+		break;
+	case COMPACT_REF:
+		*type = TYPE_REF;
+		break;
+	case COMPACT_SYMBOL:
+		*type = TYPE_SYMBOL;
+		break;
+	case COMPACT_RECORD:
+		*type = TYPE_RECORD;
+		break;
+	default:
+		PyErr_Format(PyExc_TypeError, "Unhandled type: <0x%x>", tag);
+		return -EINVAL;
+	}
+
+	size = _get_varint(buf + 1, len - 1, &value);
+	if (0 >= size)
+		return size;
+
+	if (*type == TYPE_LONG || *type == TYPE_DATETIME)
+		*arg = (long long)(value >> 1) ^ -(long long)(value & 1);
+	else if (value > INT_MAX) {
+		PyErr_Format(PyExc_MemoryError,
+			     "Unreasonable element size <%llu>",
+			     (unsigned long long)value);
+		return -EINVAL;
+	} else
+		*arg = value;
+
+	return size + 1;
+}
+
+/*
+ * read the type of the next value. for compact payloads the argument
+ * carried in or following the tag is read as well.
+ */
+static int _get_type(struct serial_buffer *b, long long *arg)
+{
+	int type;
+	int size;
+
+	if (!(b->format & FORMAT_COMPACT)) {
+		if (_check_space(b, sizeof(uint16_t)))
+			return -1;
+
+		type = _load_u16(b->buf + b->off, b->format);
+		b->off += sizeof(uint16_t);
+		return type;
+	}
+
+	size = _get_tag(b->buf + b->off, b->len - b->off, &type, arg);
+	if (!size)
+		_check_space(b, b->len - b->off + 1);
+	if (0 >= size)
+		return -1;
+
+	b->off += size;
+	return type;
+}
+
+/*
+ * length or element count of the current value, read from the data
+ * or, for compact payloads, already parsed with the type.
+ */
+static int _get_len(struct serial_buffer *b, long long arg)
+{
+	if (!(b->format & FORMAT_COMPACT))
+		return _get_size(b);
+
+	if (arg > (b->len - b->off)) {
+		PyErr_Format(PyExc_MemoryError,
+			     "Unreasonable element size <%lld> at offset <%d>",
+			     arg, b->off);
+		return -1;
+	}
+
+	return arg;
+}
+
+/*
+ * indexed payloads, read a container's encoded length and step over
+ * its offset table if present. returns the offset just beyond the
+ * container, or 0 if the payload is not indexed.
+ */
+static int _get_index(struct serial_buffer *b, int count, int table)
+{
+	int size;
+	int end;
+
+	if (!(b->format & FORMAT_INDEXED))
+		return 0;
+
+	size = _get_size(b);
+	if (0 > size)
+		return -1;
+
+	end = b->off + size;
+
+	if (table && count >= INDEX_TABLE_MIN) {
+		if (count > (size / sizeof(uint32_t))) {
+			PyErr_Format(PyExc_MemoryError,
+				     "Unreasonable element size <%d> at "
+				     "offset <%d>", count, b->off);
+			return -1;
+		}
+
+		b->off += count * sizeof(uint32_t);
+	}
+
+	return end;
+}
+
+static int _check_index(struct serial_buffer *b, int end)
+{
+	if (!end || b->off == end)
+		return 0;
+
+	PyErr_Format(PyExc_SystemError,
+		     "container length mismatch <%d> at <%d>", end, b->off);
+	return -EINVAL;
+}
+
+static int _key_cache_init(struct key_cache *c, int size)
+{
+	PyObject **slots;
+	int room;
+
+	for (room = 1; room < size && room < 0x100000; room *= 2);
+
+	slots = (0 < size) ? calloc(room, sizeof(PyObject *)) : NULL;
+	if (0 < size && !slots) {
+		PyErr_NoMemory();
+		return -ENOMEM;
+	}
+
+	c->slots = slots;
+	c->mask  = room - 1;
+	return 0;
+}
+
+static void _key_cache_free(struct key_cache *c)
+{
+	int i;
+
+	if (!c->slots)
+		return;
+
+	for (i = 0; i <= c->mask; i++)
+		Py_XDECREF(c->slots[i]);
+
+	free(c->slots);
+	c->slots = NULL;
+}
+
+static int _ref_init(struct ref_table *r, int encode)
+{
+	memset(r, 0, sizeof(*r));
+
+	if (!encode)
+		return 0;
+
+	r->mask  = 0x3f;
+	r->slots = calloc(r->mask + 1, sizeof(struct ref_slot));
+	if (!r->slots) {
+		PyErr_NoMemory();
+		return -ENOMEM;
+	}
+
+	r->strings  = PyDict_New();
+	r->unicodes = PyDict_New();
+	if (!r->strings || !r->unicodes)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void _ref_free(struct ref_table *r)
+{
+	int i;
+
+	for (i = 0; r->slots && i <= r->mask; i++)
+		Py_XDECREF(r->slots[i].key);
+
+	for (i = 0; r->objects && i < r->count; i++)
+		Py_XDECREF(r->objects[i]);
+
+	Py_XDECREF(r->strings);
+	Py_XDECREF(r->unicodes);
+
+	free(r->slots);
+	free(r->objects);
+	memset(r, 0, sizeof(*r));
+}
+
+/*
+ * decoding, reserve the index of the value being decoded. index is -1
+ * if the message does not use back references.
+ */
+static int _ref_reserve(struct serial_buffer *b, int *index)
+{
+	struct ref_table *r = b->refs;
+	PyObject **objects;
+
+	*index = -1;
+	if (!r)
+		return 0;
+
+	if (r->count == r->room) {
+		objects = realloc(r->objects,
+				  sizeof(PyObject *) * MAX(64, r->room * 2));
+		if (!objects) {
+			PyErr_NoMemory();
+			return -ENOMEM;
+		}
+
+		r->objects = objects;
+		r->room    = MAX(64, r->room * 2);
+	}
+
+	r->objects[r->count] = NULL;
+	*index = r->count++;
+	return 0;
+}
+
+static inline void _ref_set(struct serial_buffer *b, int index, PyObject *value)
+{
+	if (0 > index || !value)
+		return;
+
+	Py_INCREF(value);
+	b->refs->objects[index] = value;
+}
+
+static inline int _ref_add(struct serial_buffer *b, PyObject *value)
+{
+	int result;
+	int index;
+
+	if (!b->refs)
+		return 0;
+
+	result = _ref_reserve(b, &index);
+	if (result)
+		return result;
+
+	_ref_set(b, index, value);
+	return 0;
+}
+
+static PyObject *_ref_get(struct serial_buffer *b, long long index)
+{
+	PyObject *output;
+
+	if (!b->refs) {
+		PyErr_SetString(PyExc_TypeError, "Unexpected reference");
+		return NULL;
+	}
+
+	if (0 > index || index >= b->refs->count ||
+	    !b->refs->objects[index]) {
+		PyErr_Format(PyExc_ValueError,
+			     "Unresolved reference <%lld>", index);
+		return NULL;
+	}
+
+	output = b->refs->objects[index];
+	Py_INCREF(output);
+	return output;
+}
+
+static PyObject *_get_symbol(struct serial_buffer *b, long long index)
+{
+	struct symbol_table *t = b->opts->symbols;
+	PyObject *output;
+
+	if (!t || !(b->format & FORMAT_SYMBOLS)) {
+		PyErr_SetString(PyExc_TypeError, "Unexpected symbol");
+		return NULL;
+	}
+
+	if (0 > index || index >= PyTuple_GET_SIZE(t->names)) {
+		PyErr_Format(PyExc_ValueError,
+			     "Unresolved symbol <%lld>", index);
+		return NULL;
+	}
+
+	output = PyTuple_GET_ITEM(t->names, index);
+	Py_INCREF(output);
+	return output;
+}
+
+static PyObject *_key_cache_get
+(
+	struct key_cache *c,
+	const char *data,
+	int size,
+	int intern
+)
+{
+	PyObject **slot;
+	PyObject *output;
+	uint32_t hash = 2166136261U;
+	int i;
+	/*
+	 * FNV-1a over the raw bytes
+	 */
+	for (i = 0; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 16777619U;
+
+	slot = c->slots + (hash & c->mask);
+
+	if (*slot && PyString_GET_SIZE(*slot) == size &&
+	    !memcmp(PyString_AS_STRING(*slot), data, size)) {
+		Py_INCREF(*slot);
+		return *slot;
+	}
+
+	output = PyString_FromStringAndSize(data, size);
+	if (!output)
+		return NULL;
+
+	if (intern)
+		PyString_InternInPlace(&output);
+
+	Py_INCREF(output);
+	Py_XDECREF(*slot);
+	*slot = output;
+	return output;
+}
+
+static PyObject *_deserialize_object(struct serial_buffer *b, long long arg)
+{
+	PyObject *output = NULL;
+	PyObject *value;
+	int result = 0;
+	int size;
+
+	size = _get_len(b, arg);
+	if (0 > size)
+		goto err_load;
+
+	result = _check_space(b, size);
+	if (result)
+		goto err_load;
+
+	if (!cploads) {
+		PyErr_SetString(PyExc_TypeError, "cPickle unavailable");
+		goto err_load;
+	}
+
+	value = PyString_FromStringAndSize((b->buf + b->off), size);
+	if (!value)
+		goto err_load;
+
+	b->off += size;
+
+	output = PyObject_CallFunctionObjArgs(cploads, value, NULL);
+
+	Py_DECREF(value);
+err_load:
+	return output;
+}
+
+/*
+ * datetimes are naive and carried as microseconds since 1970-01-01.
+ * days are converted to and from the proleptic Gregorian calendar
+ * directly, w/o going through the datetime module.
+ */
+#define USEC_PER_DAY 86400000000LL
+#define DAYS_MIN     -719162	/* 0001-01-01 */
+#define DAYS_MAX     2932896	/* 9999-12-31 */
+
+static long long _days_from_civil(int y, int m, int d)
+{
+	long long era;
+	int yoe;
+	int doy;
+	int doe;
+
+	y  -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+static void _civil_from_days(long long z, int *y, int *m, int *d)
+{
+	long long era;
+	int yoe;
+	int doy;
+	int doe;
+	int mp;
+
+	z  += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp  = (5 * doy + 2) / 153;
+
+	*d = doy - (153 * mp + 2) / 5 + 1;
+	*m = mp + (mp < 10 ? 3 : -9);
+	*y = yoe + era * 400 + (*m <= 2);
+}
+
+static PyObject *_deserialize_datetime(long long usec)
+{
+	long long days = usec / USEC_PER_DAY;
+	long long rem  = usec % USEC_PER_DAY;
+	int y, m, d;
+
+	if (!PyDateTimeAPI) {
+		PyErr_SetString(PyExc_TypeError, "datetime unavailable");
+		return NULL;
+	}
+
+	if (rem < 0) {
+		rem += USEC_PER_DAY;
+		days--;
+	}
+	/*
+	 * the C API does not range check.
+	 */
+	if (days < DAYS_MIN || days > DAYS_MAX) {
+		PyErr_Format(PyExc_ValueError,
+			     "Unreasonable datetime <%lld>", usec);
+		return NULL;
+	}
+
+	_civil_from_days(days, &y, &m, &d);
+
+	return PyDateTime_FromDateAndTime(y, m, d,
+					  rem / 3600000000LL,
+					  rem / 60000000 % 60,
+					  rem / 1000000 % 60,
+					  rem % 1000000);
+}
+
+/*
+ * compact payloads, a big endian float32 or double.
+ */
+static PyObject *_deserialize_float(struct serial_buffer *b, int width)
+{
+	uint32_t narrow;
+	uint64_t wide;
+	float single;
+	double value;
+
+	if (_check_space(b, width))
+		return NULL;
+
+	if (width == sizeof(float)) {
+		narrow = _load_u32(b->buf + b->off, b->format);
+		memcpy(&single, &narrow, sizeof(single));
+		value = single;
+	} else {
+		wide = _load_u64(b->buf + b->off, b->format);
+		memcpy(&value, &wide, sizeof(value));
+	}
+
+	b->off += width;
+	return PyFloat_FromDouble(value);
+}
+
+/*
+ * packed arrays, values are byte swapped (or copied) a chunk at a time
+ * ahead of creating their objects.
+ */
+static PyObject *_deserialize_array(struct serial_buffer *b, long long arg)
+{
+	uint64_t chunk[ARRAY_CHUNK];
+	PyObject *output;
+	PyObject *value;
+	int tuple;
+	int width;
+	int count;
+	int kind;
+	int size;
+	int i, j;
+
+	count = _get_len(b, arg);
+	if (0 > count)
+		return NULL;
+
+	if (_check_space(b, sizeof(uint8_t)))
+		return NULL;
+
+	kind  = (unsigned char)b->buf[b->off++];
+	tuple = kind & ARRAY_TUPLE;
+	width = _array_width(kind);
+	if (!width) {
+		PyErr_Format(PyExc_TypeError, "Unhandled array kind: <%d>",
+			     kind);
+		return NULL;
+	}
+
+	if (count > (b->len - b->off) / width) {
+		_check_space(b, b->len - b->off + 1);
+		return NULL;
+	}
+
+	output = tuple ? PyTuple_New(count) : PyList_New(count);
+	if (!output)
+		return NULL;
+
+	for (i = 0; i < count; i += size) {
+		size = MIN(ARRAY_CHUNK, count - i);
+
+		if (!_swapped(b->format))
+			memcpy(chunk, b->buf + b->off, size * width);
+		else if (width == sizeof(uint32_t))
+			_swap_u32((char *)chunk, b->buf + b->off, size);
+		else
+			_swap_u64((char *)chunk, b->buf + b->off, size);
+
+		b->off += size * width;
+
+		for (j = 0; j < size; j++) {
+			switch (kind & ~ARRAY_TUPLE) {
+			case ARRAY_INT32:
+				value = PyInt_FromLong(((int32_t *)chunk)[j]);
+				break;
+			case ARRAY_INT64:
+#if !defined(__APPLE__)
+				value = PyInt_FromLong(((int64_t *)chunk)[j]);
+#else
+				value = PyLong_FromLongLong(((int64_t *)chunk)[j]);
+#endif
+				break;
+			default:
+				value = PyFloat_FromDouble(((double *)chunk)[j]);
+				break;
+			}
+
+			if (!value) {
+				Py_DECREF(output);
+				return NULL;
+			}
+
+			if (tuple)
+				PyTuple_SET_ITEM(output, i + j, value);
+			else
+				PyList_SET_ITEM(output, i + j, value);
+		}
+	}
+
+	return output;
+}
+
+/*
+ * numpy arrays, a read only ndarray onto the decode buffer's owner
+ * when that is an immutable string, otherwise onto a copy of the data.
+ * a bytearray or mmap owner could be resized or closed under an array
+ * referring into it, the array holds no buffer export of its owner.
+ */
+static PyObject *_deserialize_ndarray(struct serial_buffer *b, long long arg)
+{
+	PyObject *output = NULL;
+	PyObject *strides;
+	PyObject *shape;
+	PyObject *value;
+	PyObject *data;
+	PyObject *kwds;
+	Py_ssize_t offset;
+	long long extent = 0;
+	long long step;
+	long long dim;
+	const char *descr;
+	int empty;
+	int dlen;
+	int ndim;
+	int size;
+	int end;
+	int i;
+
+	size = _get_len(b, arg);
+	if (0 > size || _check_space(b, size))
+		return NULL;
+
+	end = b->off + size;
+
+	if (size < 2)
+		goto err_size;
+
+	dlen  = (unsigned char)b->buf[b->off];
+	descr = b->buf + b->off + 1;
+	if (size < dlen + 2)
+		goto err_size;
+
+	ndim = (unsigned char)b->buf[b->off + dlen + 1];
+	b->off += dlen + 2;
+
+	if ((end - b->off) < (ndim * 2 * sizeof(uint64_t)))
+		goto err_size;
+
+	if (!ndarray_type) {
+		PyErr_SetString(PyExc_TypeError, "numpy is not available");
+		return NULL;
+	}
+
+	shape   = PyTuple_New(ndim);
+	strides = PyTuple_New(ndim);
+	if (!shape || !strides)
+		goto err_tuple;
+
+	for (i = 0, empty = 0; i < ndim; i++)
+		empty |= !_load_u64(b->buf + b->off + i * sizeof(uint64_t),
+				    b->format);
+	/*
+	 * offset of the last element, which must lie within the data.
+	 */
+	for (i = 0; i < ndim; i++) {
+		dim  = _load_u64(b->buf + b->off + i * sizeof(uint64_t),
+				 b->format);
+		step = _load_u64(b->buf + b->off + (ndim + i) *
+				 sizeof(uint64_t), b->format);
+
+		if (0 > dim || 0 > step)
+			goto err_layout;
+
+		if (!empty && dim > 1 && step &&
+		    (dim - 1) > (end - b->off) / step)
+			goto err_layout;
+
+		extent += (!empty && dim > 1) ? (dim - 1) * step : 0;
+
+		PyTuple_SET_ITEM(shape, i, PyLong_FromLongLong(dim));
+		PyTuple_SET_ITEM(strides, i, PyLong_FromLongLong(step));
+		if (!PyTuple_GET_ITEM(shape, i) ||
+		    !PyTuple_GET_ITEM(strides, i))
+			goto err_tuple;
+	}
+
+	b->off += ndim * 2 * sizeof(uint64_t);
+
+	if (b->owner && PyString_CheckExact(b->owner)) {
+		offset = b->buf + b->off - PyString_AS_STRING(b->owner);
+
+		Py_INCREF(b->owner);
+		data = b->owner;
+	} else {
+		offset = 0;
+
+		data = PyString_FromStringAndSize(b->buf + b->off,
+						  end - b->off);
+		if (!data)
+			goto err_tuple;
+	}
+
+	kwds = Py_BuildValue("{s:O,s:s#,s:N,s:n,s:O}", "shape", shape,
+			     "dtype", descr, dlen, "buffer", data,
+			     "offset", offset, "strides", strides);
+	if (!kwds)
+		goto err_tuple;
+
+	output = PyObject_Call(ndarray_type, empty_tuple, kwds);
+	Py_DECREF(kwds);
+	if (!output)
+		goto err_tuple;
+
+	value = PyObject_GetAttrString(output, "itemsize");
+	if (!value)
+		goto err_array;
+
+	step = PyInt_AsLong(value);
+	Py_DECREF(value);
+
+	if (!empty && extent + step > end - b->off) {
+		PyErr_Format(PyExc_SystemError,
+			     "array layout outside data at <%d>", b->off);
+		goto err_array;
+	}
+
+	value = PyObject_CallMethod(output, "setflags", "i", 0);
+	if (!value)
+		goto err_array;
+
+	Py_DECREF(value);
+	Py_DECREF(shape);
+	Py_DECREF(strides);
+
+	b->off = end;
+	return output;
+err_layout:
+	PyErr_Format(PyExc_SystemError, "invalid array layout at <%d>",
+		     b->off);
+	goto err_tuple;
+err_array:
+	Py_DECREF(output);
+	output = NULL;
+err_tuple:
+	Py_XDECREF(shape);
+	Py_XDECREF(strides);
+	return output;
+err_size:
+	PyErr_Format(PyExc_MemoryError,
+		     "Unreasonable element size <%d> at offset <%d>",
+		     size, b->off);
+	return NULL;
+}
+
+/*
+ * explicit stacks of the encode and decode engines, which walk nested
+ * containers w/o recursing. the first frames live in the caller's stack
+ * frame, deeper nesting moves them to the heap.
+ */
+#define ENGINE_LOCAL_DEPTH 8
+
+static void *_stack_grow(void *frames, void *local, int room, int want,
+			 size_t size)
+{
+	void *output;
+
+	if (frames == local) {
+		output = malloc(size * want);
+		if (output && room)
+			memcpy(output, local, size * room);
+	} else
+		output = realloc(frames, size * want);
+
+	if (!output)
+		PyErr_NoMemory();
+
+	return output;
+}
+
+struct decode_frame {
+	PyObject *output;	/* container being filled */
+	PyObject *key;		/* dict key awaiting its value, or ext value */
+	PyObject *fields;	/* record field names */
+	PyObject *call;		/* record class, or ext decode function */
+	int type;
+	int size;		/* elements (dict pairs) expected */
+	int done;		/* elements stored */
+	int end;		/* end offset of an indexed container */
+	int index;		/* back reference set once complete, or -1 */
+};
+
+struct decode_stack {
+	int depth;
+	int room;
+	struct decode_frame *frames;
+	struct decode_frame *local;
+};
+
+static void _decode_init
+(
+	struct decode_stack *s,
+	struct decode_frame *local,
+	int room
+)
+{
+	s->depth  = 0;
+	s->room   = room;
+	s->frames = local;
+	s->local  = local;
+}
+
+/*
+ * open tuples hold NULL slots until filled. they are kept from the gc
+ * meanwhile, gc.get_objects() would otherwise hand them out between the
+ * steps of a stepped decode. open lists are never short of elements,
+ * see _decode_open_list().
+ */
+static inline int _decode_hidden(struct decode_frame *f)
+{
+	return f->size && (f->type == TYPE_TUPLE ||
+			   (f->type == TYPE_RECORD && f->call));
+}
+
+static inline void _decode_hide(struct decode_frame *f)
+{
+	if (f->output && _decode_hidden(f))
+		PyObject_GC_UnTrack(f->output);
+}
+
+/*
+ * a list is indexed as soon as it is opened, a back reference within
+ * it may then reach an extension decode function or a record class
+ * before it is complete. its room is allocated up front, but it holds
+ * only the elements stored so far, each store extends it by one.
+ */
+static inline PyObject *_decode_open_list(int size)
+{
+	PyObject *output;
+
+	output = PyList_New(size);
+	if (output)
+		Py_SIZE(output) = 0;
+
+	return output;
+}
+
+static inline void _decode_clear(struct decode_frame *f)
+{
+	Py_CLEAR(f->output);
+	Py_CLEAR(f->key);
+	Py_CLEAR(f->fields);
+	Py_CLEAR(f->call);
+}
+
+static void _decode_free(struct decode_stack *s)
+{
+	while (s->depth)
+		_decode_clear(&s->frames[--s->depth]);
+
+	if (s->frames != s->local)
+		free(s->frames);
+
+	s->frames = s->local;
+}
+
+static inline struct decode_frame *_decode_push
+(
+	struct decode_stack *s,
+	int type,
+	int size,
+	int end
+)
+{
+	struct decode_frame *f;
+	int want;
+
+	if (s->depth == s->room) {
+		want = MAX(ENGINE_LOCAL_DEPTH, s->room * 2);
+		f = _stack_grow(s->frames, s->local, s->room, want,
+				sizeof(*f));
+		if (!f)
+			return NULL;
+
+		s->frames = f;
+		s->room   = want;
+	}
+
+	f = &s->frames[s->depth++];
+
+	f->output = NULL;
+	f->key    = NULL;
+	f->fields = NULL;
+	f->call   = NULL;
+	f->type   = type;
+	f->size   = size;
+	f->done   = 0;
+	f->end    = end;
+	f->index  = -1;
+	return f;
+}
+
+/*
+ * decode one value. a leaf is returned in leaf (0), for a container a
+ * frame is pushed (1) which the engine loop then fills.
+ */
+static inline int _deserialize_value
+(
+	struct serial_buffer *b,
+	struct decode_stack *s,
+	int intern,
+	PyObject **leaf
+)
+{
+	struct schema_entry *schema;
+	struct decode_frame *f;
+	PyObject *output = NULL;
+	PyObject *value;
+	long long item;
+	long long arg;
+	int result;
+	int type;
+	int size;
+	int end;
+
+	if (s->depth > b->opts->max_depth) {
+		PyErr_Format(PyExc_SystemError,
+			     "max recursion depth <%d> exceeded",
+			     b->opts->max_depth);
+		return -EINVAL;
+	}
+
 	if (b->func) {
 		if (_check_yield(b))
+			return -EINVAL;
+	}
+
+	type = _get_type(b, &arg);
+	if (0 > type)
+		return type;
+
+	switch (type) {
+	case TYPE_INT:
+		if (b->format & FORMAT_COMPACT) {
+			output = PyInt_FromLong(arg);
+			break;
+		}
+
+		result = _check_space(b, sizeof(uint32_t));
+		if (result)
+			break;
+		output = PyInt_FromLong((int32_t)_load_u32(b->buf + b->off,
+							   b->format));
+		b->off += sizeof(uint32_t);
+		break;
+	case TYPE_LONG:
+		if (b->format & FORMAT_COMPACT)
+			item = arg;
+		else {
+			result = _check_space(b, sizeof(uint64_t));
+			if (result)
+				break;
+
+			item = _load_u64(b->buf + b->off, b->format);
+			b->off += sizeof(uint64_t);
+		}
+#if !defined(__APPLE__)
+		output = PyInt_FromLong(item);
+#else
+		output = PyLong_FromLongLong(item);
+#endif
+		break;
+	case TYPE_LONGER:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		result = _check_space(b, size);
+		if (result)
+			break;
+
+		output = _PyLong_FromByteArray(
+			(unsigned char *)(b->buf + b->off), size, 0, 1);
+		b->off += size;
+		break;
+	case TYPE_DOUBLE:
+		if (b->format & FORMAT_COMPACT) {
+			output = _deserialize_float(b, arg);
+			break;
+		}
+
+		result = _check_space(b, sizeof(double));
+		if (result)
+			break;
+		output = PyFloat_FromDouble(_load_double(b->buf + b->off,
+							 b->format));
+		b->off += sizeof(double);
+		break;
+	case TYPE_STRING:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		result = _check_space(b, size);
+		if (result)
+			break;
+
+		if (b->keys && b->keys->slots &&
+		    (intern || b->opts->cache_values) &&
+		    size <= KEY_CACHE_MAX_LEN)
+			output = _key_cache_get(b->keys, (b->buf + b->off),
+						size, intern);
+		else {
+			output = PyString_FromStringAndSize((b->buf + b->off),
+							    size);
+			if (intern && output)
+				PyString_InternInPlace(&output);
+		}
+
+		b->off += size;
+
+		if (size >= REF_MIN_LEN && output && _ref_add(b, output))
+			Py_CLEAR(output);
+		break;
+	case TYPE_UTF8:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		result = _check_space(b, size);
+		if (result)
+			break;
+
+		output = _utf8_decode((b->buf + b->off), size);
+		b->off += size;
+
+		if (size >= REF_MIN_LEN && output && _ref_add(b, output))
+			Py_CLEAR(output);
+		break;
+	case TYPE_LIST:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		end = _get_index(b, size, 1);
+		if (0 > end)
+			break;
+
+		f = _decode_push(s, type, size, end);
+		if (!f)
+			break;
+
+		f->output = _decode_open_list(size);
+		if (!f->output || _ref_add(b, f->output))
+			break;
+
+		return 1;
+	case TYPE_DICT:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		end = _get_index(b, size, 0);
+		if (0 > end)
+			break;
+
+		f = _decode_push(s, type, size, end);
+		if (!f)
+			break;
+
+		f->output = PyDict_New();
+		if (!f->output || _ref_add(b, f->output))
+			break;
+
+		return 1;
+	case TYPE_TUPLE:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		end = _get_index(b, size, 1);
+		if (0 > end)
+			break;
+
+		f = _decode_push(s, type, size, end);
+		if (!f || _ref_reserve(b, &f->index))
+			break;
+
+		f->output = PyTuple_New(size);
+		_decode_hide(f);
+		if (!f->output)
+			break;
+
+		return 1;
+	case TYPE_NULL:
+		Py_INCREF(Py_None);
+		output = Py_None;
+		break;
+	case TYPE_PICKLE:
+		output = _deserialize_object(b, arg);
+		break;
+	case TYPE_ARRAY:
+		output = _deserialize_array(b, arg);
+
+		if (output && _ref_add(b, output))
+			Py_CLEAR(output);
+		break;
+	case TYPE_NDARRAY:
+		output = _deserialize_ndarray(b, arg);
+		break;
+	case TYPE_BOOL:
+		if (!(b->format & FORMAT_COMPACT)) {
+			result = _check_space(b, sizeof(uint8_t));
+			if (result)
+				break;
+
+			arg = *(uint8_t *)(b->buf + b->off);
+			b->off += sizeof(uint8_t);
+		}
+
+		output = PyBool_FromLong(arg);
+		break;
+	case TYPE_SET:
+	case TYPE_FROZENSET:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		end = _get_index(b, size, 0);
+		if (0 > end)
+			break;
+
+		f = _decode_push(s, type, size, end);
+		if (!f || _ref_reserve(b, &f->index))
+			break;
+
+		if (type == TYPE_SET)
+			f->output = PySet_New(NULL);
+		else
+			f->output = PyFrozenSet_New(NULL);
+		if (!f->output)
+			break;
+
+		if (type == TYPE_SET) {
+			_ref_set(b, f->index, f->output);
+			f->index = -1;
+		}
+
+		return 1;
+	case TYPE_DATETIME:
+		if (!(b->format & FORMAT_COMPACT)) {
+			result = _check_space(b, sizeof(uint64_t));
+			if (result)
+				break;
+
+			arg = _load_u64(b->buf + b->off, b->format);
+			b->off += sizeof(uint64_t);
+		}
+
+		output = _deserialize_datetime(arg);
+		break;
+	case TYPE_DECIMAL:
+		size = _get_len(b, arg);
+		if (0 > size)
+			break;
+		result = _check_space(b, size);
+		if (result)
+			break;
+
+		if (!decimal_type) {
+			PyErr_SetString(PyExc_TypeError, "decimal unavailable");
+			break;
+		}
+
+		value = PyString_FromStringAndSize((b->buf + b->off), size);
+		if (!value)
+			break;
+
+		output = PyObject_CallFunctionObjArgs(decimal_type, value,
+						      NULL);
+		Py_DECREF(value);
+		b->off += size;
+		break;
+	case TYPE_EXT:
+		if (!(b->format & FORMAT_COMPACT)) {
+			result = _check_space(b, sizeof(uint32_t));
+			if (result)
+				break;
+
+			arg = _load_u32(b->buf + b->off, b->format);
+			b->off += sizeof(uint32_t);
+		}
+
+		if (0 > arg || arg > EXT_TAG_MAX || !ext_types[arg].decode) {
+			PyErr_Format(PyExc_TypeError,
+				     "Unregistered extension tag: <%lld>", arg);
+			break;
+		}
+
+		f = _decode_push(s, type, 1, 0);
+		if (!f || _ref_reserve(b, &f->index))
+			break;
+		/*
+		 * held across the nested decode, which may register the
+		 * tag again.
+		 */
+		f->call = ext_types[arg].decode;
+		Py_INCREF(f->call);
+		return 1;
+	case TYPE_REF:
+		if (!(b->format & FORMAT_COMPACT)) {
+			result = _check_space(b, sizeof(uint32_t));
+			if (result)
+				break;
+
+			arg = _load_u32(b->buf + b->off, b->format);
+			b->off += sizeof(uint32_t);
+		}
+
+		output = _ref_get(b, arg);
+		break;
+	case TYPE_SYMBOL:
+		if (!(b->format & FORMAT_COMPACT)) {
+			result = _check_space(b, sizeof(uint32_t));
+			if (result)
+				break;
+
+			arg = _load_u32(b->buf + b->off, b->format);
+			b->off += sizeof(uint32_t);
+		}
+
+		output = _get_symbol(b, arg);
+		break;
+	case TYPE_RECORD:
+		if (!(b->format & FORMAT_COMPACT)) {
+			result = _check_space(b, sizeof(uint32_t));
+			if (result)
+				break;
+
+			arg = _load_u32(b->buf + b->off, b->format);
+			b->off += sizeof(uint32_t);
+		}
+
+		schema = _schema_get(arg);
+		if (!schema)
+			break;
+
+		end = _get_index(b, 0, 0);
+		if (0 > end)
+			break;
+
+		f = _decode_push(s, type, PyTuple_GET_SIZE(schema->fields),
+				 end);
+		if (!f)
+			break;
+		/*
+		 * held across the nested decode, which may register the
+		 * schema again.
+		 */
+		f->fields = schema->fields;
+		f->call   = schema->cls;
+		Py_INCREF(f->fields);
+		Py_XINCREF(f->call);
+		/*
+		 * dicts are indexed before their values, as plain dicts
+		 * are, instances after, once cls has been called. a
+		 * reference to an instance from within its own values is
+		 * then unresolved. a list its values refer back to may
+		 * still be open, cls sees the elements stored so far.
+		 */
+		if (f->call) {
+			f->output = PyTuple_New(f->size);
+			_decode_hide(f);
+			if (!f->output || _ref_reserve(b, &f->index))
+				break;
+		} else {
+			f->output = _PyDict_NewPresized(f->size);
+			if (!f->output || _ref_add(b, f->output))
+				break;
+		}
+
+		return 1;
+	default:
+		PyErr_Format(PyExc_TypeError, "Unhandled type: <%d>", type);
+		break;
+	}
+
+	*leaf = output;
+	return output ? 0 : -EINVAL;
+}
+
+/*
+ * store a decoded element, stealing it, in the container of frame f.
+ */
+static inline int _decode_store(struct decode_frame *f, PyObject *value)
+{
+	PyListObject *list;
+	int result = 0;
+
+	switch (f->type) {
+	case TYPE_LIST:
+		/*
+		 * code the open list was handed to may have resized it.
+		 */
+		list = (PyListObject *)f->output;
+		if (Py_SIZE(list) < list->allocated) {
+			list->ob_item[Py_SIZE(list)] = value;
+			Py_SIZE(list)++;
+			break;
+		}
+
+		result = PyList_Append(f->output, value);
+		Py_DECREF(value);
+		break;
+	case TYPE_TUPLE:
+		PyTuple_SET_ITEM(f->output, f->done, value);
+		break;
+	case TYPE_DICT:
+		if (!f->key) {
+			f->key = value;
+			return 0;
+		}
+
+		result = PyDict_SetItem(f->output, f->key, value);
+		Py_CLEAR(f->key);
+		Py_DECREF(value);
+		break;
+	case TYPE_SET:
+	case TYPE_FROZENSET:
+		/*
+		 * Add works on a frozenset while it is not shared.
+		 */
+		result = PySet_Add(f->output, value);
+		Py_DECREF(value);
+		break;
+	case TYPE_RECORD:
+		if (f->call) {
+			PyTuple_SET_ITEM(f->output, f->done, value);
+			break;
+		}
+
+		result = PyDict_SetItem(f->output,
+					PyTuple_GET_ITEM(f->fields, f->done),
+					value);
+		Py_DECREF(value);
+		break;
+	case TYPE_EXT:
+		f->key = value;
+		break;
+	}
+
+	f->done++;
+	return result;
+}
+
+/*
+ * complete the container of frame f, once all its elements are stored.
+ * returns it, or NULL, and leaves the frame empty.
+ */
+static inline PyObject *_decode_close
+(
+	struct serial_buffer *b,
+	struct decode_frame *f
+)
+{
+	PyObject *output;
+	PyObject *value;
+
+	output    = f->output;
+	f->output = NULL;
+
+	if (_decode_hidden(f))
+		PyObject_GC_Track(output);
+
+	if (f->type == TYPE_EXT)
+		output = PyObject_CallFunctionObjArgs(f->call, f->key, NULL);
+	else if (_check_index(b, f->end))
+		Py_CLEAR(output);
+	else if (f->call) {
+		value  = output;
+		output = PyObject_Call(f->call, value, NULL);
+		Py_DECREF(value);
+	}
+
+	_ref_set(b, f->index, output);
+	_decode_clear(f);
+	return output;
+}
+
+/*
+ * decode engine. nested containers are walked w/o recursion, each open
+ * one has a frame on an explicit stack, so that the nesting depth is
+ * not bound by the size of the C stack. the value is returned in output
+ * (0), or, for a stepped decode, -EAGAIN once the step is over; the
+ * stack then holds all progress and is passed back in to resume.
+ */
+static int _decode_run
+(
+	struct serial_buffer *b,
+	struct decode_stack *s,
+	int intern,
+	PyObject **output
+)
+{
+	struct decode_frame *f = NULL;
+	PyObject *value = NULL;
+	int result;
+	int stop;
+
+	stop = b->stop ? b->stop : INT_MAX;
+
+	if (s->depth) {
+		f = &s->frames[s->depth - 1];
+		intern = f->type == TYPE_DICT && !f->key;
+	}
+
+	for (;;) {
+		if (b->off >= stop) {
+			if (_step_expired(b))
+				return -EAGAIN;
+
+			stop = b->stop;
+		}
+
+		result = _deserialize_value(b, s, intern, &value);
+		if (0 > result)
+			return result;
+		/*
+		 * a completed value is stored in its container, closing that
+		 * in turn once it has all its elements. a container just
+		 * opened is filled first.
+		 */
+		while (s->depth) {
+			f = &s->frames[s->depth - 1];
+			if (!result && _decode_store(f, value))
+				return -EINVAL;
+
+			if (f->done < f->size)
+				break;
+
+			value = _decode_close(b, f);
+			s->depth--;
+			if (!value)
+				return -EINVAL;
+
+			result = 0;
+		}
+
+		if (!s->depth)
+			break;
+
+		intern = f->type == TYPE_DICT && !f->key;
+	}
+
+	*output = value;
+	return 0;
+}
+
+static PyObject *_deserialize(struct serial_buffer *b, int intern)
+{
+	struct decode_frame local[ENGINE_LOCAL_DEPTH];
+	struct decode_stack stack;
+	PyObject *value = NULL;
+
+	if (!b) {
+		PyErr_SetString(PyExc_SystemError, "missing buffer object");
+		return NULL;
+	}
+
+	_decode_init(&stack, local, ENGINE_LOCAL_DEPTH);
+
+	if (_decode_run(b, &stack, intern, &value))
+		value = NULL;
+
+	_decode_free(&stack);
+	return value;
+}
+
+/*
+ * decode the value following the format header. messages using back
+ * references carry a table of the values decoded so far.
+ */
+static PyObject *_deserialize_body(struct serial_buffer *b, int intern)
+{
+	struct ref_table refs;
+	PyObject *output;
+
+	if (!(b->format & FORMAT_REFS))
+		return _deserialize(b, intern);
+
+	_ref_init(&refs, 0);
+
+	b->refs = &refs;
+	output  = _deserialize(b, intern);
+	b->refs = NULL;
+
+	_ref_free(&refs);
+	return output;
+}
+
+/*
+ * decompress the body of a compressed message, whose header b has just
+ * stepped over, into a new string and set up inner to decode from it.
+ * b is left beyond the message.
+ */
+static PyObject *_inflate(struct serial_buffer *b, struct serial_buffer *inner)
+{
+	PyObject *output;
+	uint32_t packed;
+	uint32_t size;
+	int result;
+
+	size   = _load_u32(b->buf + b->off - FORMAT_LZ_LEN, b->format);
+	packed = _load_u32(b->buf + b->off - sizeof(uint32_t), b->format);
+
+	if (packed > INT_MAX || size > INT_MAX || size > _lz_bound(packed) * 255) {
+		PyErr_Format(PyExc_MemoryError,
+			     "Unreasonable compressed size <%u> of <%u> at "
+			     "offset <%d>", packed, size, b->off);
+		return NULL;
+	}
+
+	if (_check_space(b, packed))
+		return NULL;
+
+	output = PyString_FromStringAndSize(NULL, size);
+	if (!output)
+		return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	result = _lz_decompress(b->buf + b->off, packed,
+				PyString_AS_STRING(output), size);
+	Py_END_ALLOW_THREADS
+
+	if (result != (int)size) {
+		PyErr_Format(PyExc_ValueError,
+			     "Malformed compressed data at offset <%d>", b->off);
+		Py_DECREF(output);
+		return NULL;
+	}
+
+	*inner = *b;
+	inner->buf    = PyString_AS_STRING(output);
+	inner->len    = size;
+	inner->off    = 0;
+	inner->last   = 0;
+	inner->owner  = output;
+	inner->format = b->format & ~FORMAT_LZ;
+
+	b->off += packed;
+	return output;
+}
+
+static PyObject *_deserialize_packed(struct serial_buffer *b)
+{
+	struct serial_buffer inner;
+	PyObject *output;
+	PyObject *raw;
+
+	raw = _inflate(b, &inner);
+	if (!raw)
+		return NULL;
+
+	output = _deserialize_body(&inner, 0);
+	if (output && inner.off != inner.len) {
+		PyErr_Format(PyExc_SystemError,
+			     "compressed length mismatch <%d> at <%d>",
+			     inner.len, inner.off);
+		Py_CLEAR(output);
+	}
+
+	Py_DECREF(raw);
+	return output;
+}
+
+/*
+ * decode one complete message, format header included.
+ */
+static PyObject *_deserialize_message(struct serial_buffer *b)
+{
+	int size;
+
+	size = _get_header(b->buf + b->off, b->len - b->off, &b->format);
+	if (size == -EAGAIN)
+		_check_space(b, FORMAT_HEADER_MAX);
+	if (0 > size)
+		return NULL;
+
+	if (_check_frame(b->buf + b->off, b->len - b->off, &b->format,
+			 b->opts->checksum))
+		return NULL;
+
+	if (_check_symbols(b->opts->symbols, b->buf + b->off, b->format))
+		return NULL;
+
+	b->off += size;
+	if (b->format & FORMAT_LZ)
+		return _deserialize_packed(b);
+
+	return _deserialize_body(b, 0);
+}
+
+/*
+ * resumable structure scanner. walks encoded values w/o building any
+ * objects, to find where a message ends. all state is kept in the
+ * scan_state so a scan stopped for lack of data picks up where it
+ * left off once more data arrives.
+ */
+struct scan_state {
+	int  pos;	/* offset of the next value header */
+	int  body;	/* format header, if any, has been read */
+	int  format;	/* format flags */
+	int  depth;	/* open containers */
+	int  room;	/* stack capacity */
+	int *stack;	/* elements remaining in each open container */
+};
+
+static void _scan_free(struct scan_state *s)
+{
+	free(s->stack);
+	memset(s, 0, sizeof(*s));
+}
+
+static int _scan_push(struct scan_state *s, int count, int max_depth)
+{
+	int *new;
+
+	if (s->depth >= max_depth) {
+		PyErr_Format(PyExc_SystemError,
+			     "max recursion depth <%d> exceeded", max_depth);
+		return -EINVAL;
+	}
+
+	if (s->depth == s->room) {
+		new = realloc(s->stack, sizeof(int) * MAX(16, s->room * 2));
+		if (!new) {
+			PyErr_NoMemory();
+			return -ENOMEM;
+		}
+
+		s->stack = new;
+		s->room  = MAX(16, s->room * 2);
+	}
+
+	s->stack[s->depth++] = count;
+	return 0;
+}
+
+/*
+ * returns 1 once a complete top level value has been scanned (pos is
+ * then the offset just beyond it), 0 if more data is required, and a
+ * negative value on malformed input.
+ */
+static int _scan(struct scan_state *s, const char *buf, int len, int max_depth)
+{
+	struct schema_entry *schema;
+	long long arg;
+	uint32_t size;
+	int count;
+	int width;
+	int head;
+	int type;
+
+	if (!s->body) {
+		head = _get_header(buf + s->pos, len - s->pos, &s->format);
+		if (head == -EAGAIN)
+			return 0;
+		if (0 > head)
+			return head;
+
+		/*
+		 * framed messages, and compressed bodies, are stepped over
+		 * whole.
+		 */
+		width = 0;
+		size  = 0;
+		if (s->format & FORMAT_CRC) {
+			width = FORMAT_HEADER_LEN + FORMAT_CRC_LEN;
+			if (s->format & FORMAT_SYMBOLS)
+				width += FORMAT_SYMBOLS_LEN;
+
+			size = _load_u32(buf + s->pos + width - FORMAT_CRC_LEN,
+					 s->format);
+		} else if (s->format & FORMAT_LZ) {
+			width = head;
+			size  = _load_u32(buf + s->pos + head -
+					  sizeof(uint32_t), s->format);
+		}
+
+		if (width) {
+			if (size > INT_MAX - s->pos - width) {
+				PyErr_Format(PyExc_MemoryError,
+					     "Unreasonable message size <%u> "
+					     "at offset <%d>", size, s->pos);
+				return -EINVAL;
+			}
+
+			head = width + size;
+		}
+
+		s->pos += head;
+		s->body = 1;
+	}
+
+	if (s->format & (FORMAT_CRC | FORMAT_LZ))
+		return len >= s->pos;
+
+	for (;;) {
+		if (s->format & FORMAT_COMPACT) {
+			head = _get_tag(buf + s->pos, len - s->pos, &type, &arg);
+			if (0 >= head)
+				return head;
+			/*
+			 * int values are carried in the tag/varint.
+			 */
+			if (type == TYPE_INT || type == TYPE_LONG ||
+			    type == TYPE_BOOL || type == TYPE_DATETIME)
+				arg = 0;
+		} else {
+			if ((len - s->pos) < sizeof(uint16_t))
+				return 0;
+
+			type = _load_u16(buf + s->pos, s->format);
+			head = sizeof(uint16_t);
+
+			switch (type) {
+			case TYPE_NULL:
+				arg = 0;
+				break;
+			case TYPE_BOOL:
+				arg = sizeof(uint8_t);
+				break;
+			case TYPE_INT:
+				arg = sizeof(uint32_t);
+				break;
+			case TYPE_LONG:
+			case TYPE_DOUBLE:
+			case TYPE_DATETIME:
+				arg = sizeof(uint64_t);
+				break;
+			case TYPE_STRING:
+			case TYPE_UTF8:
+			case TYPE_LONGER:
+			case TYPE_PICKLE:
+			case TYPE_LIST:
+			case TYPE_TUPLE:
+			case TYPE_DICT:
+			case TYPE_ARRAY:
+			case TYPE_NDARRAY:
+			case TYPE_EXT:
+			case TYPE_SET:
+			case TYPE_FROZENSET:
+			case TYPE_DECIMAL:
+			case TYPE_REF:
+			case TYPE_SYMBOL:
+			case TYPE_RECORD:
+				head += sizeof(uint32_t);
+				if ((len - s->pos) < head)
+					return 0;
+
+				arg = _load_u32(buf + s->pos + head -
+						sizeof(uint32_t), s->format);
+				break;
+			default:
+				PyErr_Format(PyExc_TypeError,
+					     "Unhandled type: <%d>", type);
+				return -EINVAL;
+			}
+		}
+
+		count = 0;
+		size  = 0;
+
+		switch (type) {
+		case TYPE_RECORD:
+			/*
+			 * the argument is the schema id, which gives the
+			 * field count.
+			 */
+			schema = _schema_get(arg);
+			if (!schema)
+				return -EINVAL;
+
+			arg = PyTuple_GET_SIZE(schema->fields);
+			/* fall through */
+		case TYPE_LIST:
+		case TYPE_TUPLE:
+		case TYPE_DICT:
+		case TYPE_SET:
+		case TYPE_FROZENSET:
+			count = arg;
+			if (0 > count || count > INT_MAX / 2) {
+				PyErr_Format(PyExc_MemoryError,
+					     "Unreasonable element size <%d> "
+					     "at offset <%d>", count, s->pos);
+				return -EINVAL;
+			}
+
+			if (type == TYPE_DICT)
+				count *= 2;
+
+			if (!(s->format & FORMAT_INDEXED))
+				break;
+			/*
+			 * indexed containers are skipped whole.
+			 */
+			head += sizeof(uint32_t);
+			if ((len - s->pos) < head)
+				return 0;
+
+			size  = _load_u32(buf + s->pos + head -
+					  sizeof(uint32_t), s->format);
+			count = 0;
+			break;
+		case TYPE_ARRAY:
+			head += sizeof(uint8_t);
+			if ((len - s->pos) < head)
+				return 0;
+
+			width = _array_width((unsigned char)
+					     buf[s->pos + head - 1]);
+			if (!width || arg > INT_MAX / 16) {
+				PyErr_Format(PyExc_TypeError,
+					     "Unhandled array <%lld> at offset "
+					     "<%d>", arg, s->pos);
+				return -EINVAL;
+			}
+
+			size = arg * width;
+			break;
+		case TYPE_EXT:
+			/*
+			 * the argument is the extension tag, the value
+			 * follows.
+			 */
+			count = 1;
+			break;
+		case TYPE_REF:
+		case TYPE_SYMBOL:
+			break;
+		default:
+			size = arg;
+			break;
+		}
+
+		if (size > INT_MAX / 2) {
+			PyErr_Format(PyExc_MemoryError,
+				     "Unreasonable element size <%u> at "
+				     "offset <%d>", size, s->pos);
+			return -EINVAL;
+		}
+
+		if ((len - s->pos - head) < size)
+			return 0;
+
+		s->pos += head + size;
+
+		if (s->depth)
+			s->stack[s->depth - 1]--;
+
+		if (count && _scan_push(s, count, max_depth))
+			return -EINVAL;
+
+		while (s->depth && !s->stack[s->depth - 1])
+			s->depth--;
+
+		if (!s->depth)
+			return 1;
+	}
+}
+
+/*
+ * step over the value at the current offset w/o decoding it.
+ */
+static int _skip(struct serial_buffer *b, struct scan_state *s)
+{
+	int result;
+
+	s->pos    = b->off;
+	s->body   = 1;
+	s->format = b->format;
+	s->depth  = 0;
+
+	result = _scan(s, b->buf, b->len, b->opts->max_depth);
+	if (!result)
+		_check_space(b, b->len - b->off + 1);
+	if (result <= 0)
+		return -EINVAL;
+
+	b->off = s->pos;
+	return 0;
+}
+
+/*
+ * projection decode. select paths are compiled into a tree of entries,
+ * each a [positions, children] list: the result positions of the paths
+ * ending at the entry, and a dict of entries for the paths continuing
+ * below it, by key or list index.
+ */
+static PyObject *_select_entry(void)
+{
+	return Py_BuildValue("[NN]", PyList_New(0), PyDict_New());
+}
+
+static PyObject *_select_compile(PyObject *select)
+{
+	PyObject *children;
+	PyObject *output;
+	PyObject *entry;
+	PyObject *child;
+	PyObject *path;
+	PyObject *pos;
+	Py_ssize_t i, j;
+	int result;
+
+	output = _select_entry();
+	if (!output)
+		goto error;
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(select); i++) {
+		path = PySequence_Fast_GET_ITEM(select, i);
+		if (PyString_Check(path) || PyUnicode_Check(path))
+			path = Py_BuildValue("(O)", path);
+		else
+			path = PySequence_Fast(path, "select path must be a "
+					       "sequence of keys");
+		if (!path)
+			goto error;
+
+		entry = output;
+
+		for (j = 0; j < PySequence_Fast_GET_SIZE(path); j++) {
+			children = PyList_GET_ITEM(entry, 1);
+
+			child = PyDict_GetItem(children,
+					       PySequence_Fast_GET_ITEM(path, j));
+			if (!child) {
+				child = _select_entry();
+				if (!child)
+					break;
+
+				result = PyDict_SetItem(children,
+					PySequence_Fast_GET_ITEM(path, j),
+					child);
+				Py_DECREF(child);
+				if (result)
+					break;
+			}
+
+			entry = child;
+		}
+
+		if (j < PySequence_Fast_GET_SIZE(path)) {
+			Py_DECREF(path);
+			goto error;
+		}
+
+		Py_DECREF(path);
+
+		pos = PyInt_FromSsize_t(i);
+		if (!pos)
+			goto error;
+
+		result = PyList_Append(PyList_GET_ITEM(entry, 0), pos);
+		Py_DECREF(pos);
+		if (result)
+			goto error;
+	}
+
+	return output;
+error:
+	Py_XDECREF(output);
+	return NULL;
+}
+
+static int _select_store(PyObject *positions, PyObject *value, PyObject *output)
+{
+	PyObject *old;
+	Py_ssize_t i;
+	int pos;
+
+	for (i = 0; i < PyList_GET_SIZE(positions); i++) {
+		pos = PyInt_AS_LONG(PyList_GET_ITEM(positions, i));
+		old = PyTuple_GET_ITEM(output, pos);
+
+		Py_INCREF(value);
+		PyTuple_SET_ITEM(output, pos, value);
+		Py_DECREF(old);
+	}
+
+	return 0;
+}
+
+/*
+ * paths continuing below a value which had to be decoded anyway are
+ * resolved on the decoded object. as when selecting from the encoded
+ * data, only lists, tuples and dicts are descended into.
+ */
+static int _select_object(PyObject *input, PyObject *children, PyObject *output)
+{
+	struct schema_entry *schema;
+	Py_ssize_t i = 0;
+	PyObject *entry;
+	PyObject *value;
+	PyObject *key;
+	long pos;
+	int result;
+
+	schema = _schema_instance(input);
+	if (!schema && !PyList_Check(input) && !PyTuple_Check(input) &&
+	    !PyDict_Check(input))
+		return 0;
+
+	while (PyDict_Next(children, &i, &key, &entry)) {
+		if (!schema)
+			value = PyObject_GetItem(input, key);
+		else {
+			/*
+			 * a record instance is looked into by field name, as
+			 * a record is in the message.
+			 */
+			value = PyDict_GetItem(schema->index, key);
+			if (!value)
+				continue;
+
+			pos = PyInt_AS_LONG(value);
+			if (PyTuple_Check(input) &&
+			    pos < PyTuple_GET_SIZE(input)) {
+				value = PyTuple_GET_ITEM(input, pos);
+				Py_INCREF(value);
+			} else
+				value = PyObject_GetAttr(input, key);
+		}
+
+		if (!value) {
+			if (!PyErr_ExceptionMatches(PyExc_LookupError) &&
+			    !PyErr_ExceptionMatches(PyExc_TypeError) &&
+			    !PyErr_ExceptionMatches(PyExc_AttributeError))
+				return -EINVAL;
+
+			PyErr_Clear();
+			continue;
+		}
+
+		_select_store(PyList_GET_ITEM(entry, 0), value, output);
+		result = _select_object(value, PyList_GET_ITEM(entry, 1),
+					output);
+		Py_DECREF(value);
+		if (result)
+			return result;
+	}
+
+	return 0;
+}
+
+static int _select_value(struct serial_buffer *, struct scan_state *,
+			 PyObject *, PyObject *);
+
+static int _select_dict
+(
+	struct serial_buffer *b,
+	struct scan_state *s,
+	long long arg,
+	PyObject *children,
+	PyObject *output
+)
+{
+	Py_ssize_t remain;
+	PyObject *entry;
+	PyObject *key;
+	int result;
+	int count;
+	int end;
+
+	count = _get_len(b, arg);
+	if (0 > count)
+		return -EINVAL;
+
+	end = _get_index(b, count, 0);
+	if (0 > end)
+		return -EINVAL;
+
+	remain = PyDict_Size(children);
+
+	for (; count && remain; count--) {
+		key = _deserialize(b, 1);
+		if (!key)
+			return -EINVAL;
+
+		entry = PyDict_GetItem(children, key);
+		Py_DECREF(key);
+
+		if (entry) {
+			remain--;
+			result = _select_value(b, s, entry, output);
+		} else
+			result = _skip(b, s);
+		if (result)
+			return result;
+	}
+	/*
+	 * everything selected has been found, step over the rest.
+	 */
+	if (end) {
+		b->off = end;
+		return 0;
+	}
+
+	for (count *= 2; count; count--)
+		if (_skip(b, s))
+			return -EINVAL;
+
+	return 0;
+}
+
+static int _select_record
+(
+	struct serial_buffer *b,
+	struct scan_state *s,
+	long long arg,
+	PyObject *children,
+	PyObject *output
+)
+{
+	struct schema_entry *schema;
+	Py_ssize_t remain;
+	PyObject *fields;
+	PyObject *entry;
+	int result = 0;
+	int count;
+	int end;
+	int i;
+
+	if (!(b->format & FORMAT_COMPACT)) {
+		if (_check_space(b, sizeof(uint32_t)))
+			return -EINVAL;
+
+		arg = _load_u32(b->buf + b->off, b->format);
+		b->off += sizeof(uint32_t);
+	}
+
+	schema = _schema_get(arg);
+	if (!schema)
+		return -EINVAL;
+
+	end = _get_index(b, 0, 0);
+	if (0 > end)
+		return -EINVAL;
+
+	fields = schema->fields;
+	Py_INCREF(fields);
+
+	count  = PyTuple_GET_SIZE(fields);
+	remain = PyDict_Size(children);
+
+	for (i = 0; i < count && remain && !result; i++) {
+		entry = PyDict_GetItem(children, PyTuple_GET_ITEM(fields, i));
+		if (entry) {
+			remain--;
+			result = _select_value(b, s, entry, output);
+		} else
+			result = _skip(b, s);
+	}
+	/*
+	 * everything selected has been found, step over the rest.
+	 */
+	if (end && !result)
+		b->off = end;
+	else
+		for (; i < count && !result; i++)
+			result = _skip(b, s);
+
+	Py_DECREF(fields);
+	return result;
+}
+
+struct select_index {
+	int       index;
+	PyObject *entry;
+};
+
+static int _select_index_cmp(const void *a, const void *b)
+{
+	return ((struct select_index *)a)->index -
+		((struct select_index *)b)->index;
+}
+
+static int _select_list
+(
+	struct serial_buffer *b,
+	struct scan_state *s,
+	long long arg,
+	PyObject *children,
+	PyObject *output
+)
+{
+	struct select_index *wanted;
+	Py_ssize_t i = 0;
+	PyObject *entry;
+	PyObject *key;
+	int result = 0;
+	int count;
+	int table;
+	int first;
+	int last;
+	int size;
+	int end;
+	int pos;
+	int n;
+
+	count = _get_len(b, arg);
+	if (0 > count)
+		return -EINVAL;
+
+	table = b->off + sizeof(uint32_t);
+
+	end = _get_index(b, count, 1);
+	if (0 > end)
+		return -EINVAL;
+
+	if (!end || count < INDEX_TABLE_MIN)
+		table = -1;
+	/*
+	 * wanted element indexes in ascending order.
+	 */
+	wanted = malloc(sizeof(*wanted) * MAX(PyDict_Size(children), 1));
+	if (!wanted) {
+		PyErr_NoMemory();
+		return -ENOMEM;
+	}
+
+	for (size = 0; PyDict_Next(children, &i, &key, &entry); ) {
+		if (!PyInt_Check(key) && !PyLong_Check(key))
+			continue;
+
+		n = PyInt_AsLong(key);
+		if (n == -1 && PyErr_Occurred()) {
+			PyErr_Clear();
+			continue;
+		}
+
+		n += (n < 0) ? count : 0;
+		if (n < 0 || n >= count)
+			continue;
+
+		wanted[size].index = n;
+		wanted[size].entry = entry;
+		size++;
+	}
+
+	qsort(wanted, size, sizeof(*wanted), _select_index_cmp);
+
+	first = b->off;
+
+	for (i = 0, pos = 0, last = -1; i < size && !result; i++) {
+		n = wanted[i].index;
+
+		if (0 <= table)
+			b->off = first + _load_u32(b->buf + table +
+						   n * sizeof(uint32_t),
+						   b->format);
+		else if (n == last)
+			b->off = pos;
+		else
+			for (; n > last + 1 && !result; last++)
+				result = _skip(b, s);
+
+		if (result)
+			break;
+
+		if (b->off < first || b->off >= b->len) {
+			PyErr_Format(PyExc_SystemError,
+				     "element offset <%d> outside <%d>",
+				     b->off, b->len);
+			result = -EINVAL;
+			break;
+		}
+
+		pos  = b->off;
+		last = n;
+
+		result = _select_value(b, s, wanted[i].entry, output);
+	}
+
+	free(wanted);
+	if (result)
+		return result;
+
+	if (end) {
+		b->off = end;
+		return 0;
+	}
+
+	if (0 <= table)
+		return 0;
+
+	for (last++; last < count; last++)
+		if (_skip(b, s))
+			return -EINVAL;
+
+	return 0;
+}
+
+static int _select_value
+(
+	struct serial_buffer *b,
+	struct scan_state *s,
+	PyObject *entry,
+	PyObject *output
+)
+{
+	PyObject *positions = PyList_GET_ITEM(entry, 0);
+	PyObject *children  = PyList_GET_ITEM(entry, 1);
+	PyObject *value;
+	long long arg;
+	int result;
+	int start;
+	int type;
+
+	if (PyList_GET_SIZE(positions)) {
+		value = _deserialize(b, 0);
+		if (!value)
+			return -EINVAL;
+
+		_select_store(positions, value, output);
+		result = _select_object(value, children, output);
+		Py_DECREF(value);
+		return result;
+	}
+
+	start = b->off;
+
+	type = _get_type(b, &arg);
+	if (0 > type)
+		return -EINVAL;
+
+	switch (type) {
+	case TYPE_DICT:
+		return _select_dict(b, s, arg, children, output);
+	case TYPE_RECORD:
+		return _select_record(b, s, arg, children, output);
+	case TYPE_LIST:
+	case TYPE_TUPLE:
+		return _select_list(b, s, arg, children, output);
+	case TYPE_ARRAY:
+		value = _deserialize_array(b, arg);
+		if (!value)
+			return -EINVAL;
+
+		result = _select_object(value, children, output);
+		Py_DECREF(value);
+		return result;
+	default:
+		b->off = start;
+		return _skip(b, s);
+	}
+}
+
+/*
+ * decode only the values at the selected paths of one message, into a
+ * tuple of the same length as select. paths which are not present
+ * are left as fallback.
+ */
+static PyObject *_select_message
+(
+	struct serial_buffer *b,
+	PyObject *select,
+	PyObject *fallback
+)
+{
+	struct serial_buffer inner;
+	struct scan_state scan;
+	PyObject *raw = NULL;
+	PyObject *output;
+	PyObject *value;
+	PyObject *root;
+	Py_ssize_t i;
+	int size;
+
+	select = PySequence_Fast(select, "select must be a sequence of paths");
+	if (!select)
+		return NULL;
+
+	root = _select_compile(select);
+	if (!root) {
+		Py_DECREF(select);
+		return NULL;
+	}
+
+	output = PyTuple_New(PySequence_Fast_GET_SIZE(select));
+	Py_DECREF(select);
+	if (!output) {
+		Py_DECREF(root);
+		return NULL;
+	}
+
+	for (i = 0; i < PyTuple_GET_SIZE(output); i++) {
+		Py_INCREF(fallback);
+		PyTuple_SET_ITEM(output, i, fallback);
+	}
+
+	memset(&scan, 0, sizeof(scan));
+
+	size = _get_header(b->buf + b->off, b->len - b->off, &b->format);
+	if (size == -EAGAIN)
+		_check_space(b, FORMAT_HEADER_MAX);
+	if (0 > size)
+		goto error;
+
+	if (_check_frame(b->buf + b->off, b->len - b->off, &b->format,
+			 b->opts->checksum))
+		goto error;
+
+	if (_check_symbols(b->opts->symbols, b->buf + b->off, b->format))
+		goto error;
+
+	b->off += size;
+	/*
+	 * a compressed body is decompressed first, and selected from.
+	 */
+	if (b->format & FORMAT_LZ) {
+		raw = _inflate(b, &inner);
+		if (!raw)
+			goto error;
+
+		b = &inner;
+	}
+	/*
+	 * back references may point anywhere earlier in the message, so
+	 * such messages are decoded whole.
+	 */
+	if (b->format & FORMAT_REFS) {
+		value = _deserialize_body(b, 0);
+		if (!value)
+			goto error;
+
+		_select_store(PyList_GET_ITEM(root, 0), value, output);
+		size = _select_object(value, PyList_GET_ITEM(root, 1), output);
+		Py_DECREF(value);
+		if (size)
+			goto error;
+	} else if (_select_value(b, &scan, root, output))
+		goto error;
+
+	_scan_free(&scan);
+	Py_XDECREF(raw);
+	Py_DECREF(root);
+	return output;
+error:
+	_scan_free(&scan);
+	Py_XDECREF(raw);
+	Py_DECREF(output);
+	Py_DECREF(root);
+	return NULL;
+}
+
+static int _sink_write(struct stream_sink *sink, const char *data, int size)
+{
+	PyObject *result;
+	PyObject *chunk;
+	ssize_t done;
+
+	if (sink->write) {
+		chunk = PyString_FromStringAndSize(data, size);
+		if (!chunk)
+			return -ENOMEM;
+
+		result = PyObject_CallFunctionObjArgs(sink->write, chunk, NULL);
+		Py_DECREF(chunk);
+		if (!result)
+			return -EIO;
+
+		Py_DECREF(result);
+		sink->total += size;
+		return 0;
+	}
+
+	while (size) {
+		Py_BEGIN_ALLOW_THREADS
+		done = write(sink->fd, data, size);
+		Py_END_ALLOW_THREADS
+
+		if (0 > done && errno == EINTR) {
+			if (PyErr_CheckSignals())
+				return -EINTR;
+			continue;
+		}
+
+		if (0 > done) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -EIO;
+		}
+
+		sink->total += done;
+		data += done;
+		size -= done;
+	}
+
+	return 0;
+}
+
+static int _flush(struct serial_buffer *b)
+{
+	int result;
+
+	if (!b->off)
+		return 0;
+
+	result = _sink_write(b->sink, b->buf, b->off);
+	if (result)
+		return result;
+	/*
+	 * keep the yield period relative to the bytes actually encoded.
+	 */
+	b->last -= b->off;
+	b->off   = 0;
+	return 0;
+}
+
+/*
+ * make room for size more bytes.
+ */
+static int _check_room(struct serial_buffer *buffer, int size)
+{
+	char *new;
+	/*
+	 * sizing pass, nothing is written only the offset is advanced.
+	 */
+	if (!buffer->buf)
+		return 0;
+
+	while ((buffer->len - buffer->off) < size) {
+		if (buffer->fixed) {
+			PyErr_Format(PyExc_SystemError,
+				     "encode overflow <%d> at <%d> of <%d>",
+				     size, buffer->off, buffer->len);
+			return -ENOSPC;
+		}
+
+		if (buffer->sink && buffer->off) {
+			if (_flush(buffer))
+				return -EIO;
+			continue;
+		}
+
+		new = realloc(buffer->buf, (buffer->len * 2));
+		if (!new) {
+			PyErr_Format(PyExc_MemoryError,
+				     "failed to reallocate buffer to <%d>",
+				     buffer->len * 2);
+			return -ENOMEM;
+		}
+
+		buffer->buf = new;
+		buffer->len = buffer->len * 2;
+	}
+
+	return 0;
+}
+
+/*
+ * make room for a value, its type tag and size bytes following it.
+ */
+static inline int _check_size(struct serial_buffer *buffer, int size)
+{
+	if (buffer->format & FORMAT_COMPACT)
+		return _check_room(buffer, size + sizeof(uint8_t));
+
+	return _check_room(buffer, size + sizeof(uint16_t));
+}
+
+/*
+ * primitive encoders. space must already have been reserved with
+ * _check_size(), when sizing (no buffer) only the offset moves.
+ */
+static inline void _put_type(struct serial_buffer *b, int type)
+{
+	if (b->buf)
+		_store_u16(b->buf + b->off, type, b->format);
+	b->off += sizeof(uint16_t);
+}
+
+static inline void _put_u32(struct serial_buffer *b, uint32_t value)
+{
+	if (b->buf)
+		_store_u32(b->buf + b->off, value, b->format);
+	b->off += sizeof(uint32_t);
+}
+
+static inline void _put_u64(struct serial_buffer *b, uint64_t value)
+{
+	if (b->buf)
+		_store_u64(b->buf + b->off, value, b->format);
+	b->off += sizeof(uint64_t);
+}
+
+static inline void _put_double(struct serial_buffer *b, double value)
+{
+	if (b->buf)
+		_store_double(b->buf + b->off, value, b->format);
+	b->off += sizeof(double);
+}
+
+static inline void _put_bytes(struct serial_buffer *b, const char *s, int size)
+{
+	if (b->buf)
+		memcpy((b->buf + b->off), s, size);
+	b->off += size;
+}
+
+static inline void _put_u8(struct serial_buffer *b, int value)
+{
+	if (b->buf)
+		*(uint8_t *)(b->buf + b->off) = value;
+	b->off += sizeof(uint8_t);
+}
+
+static inline void _patch_u32(struct serial_buffer *b, int off, uint32_t value)
+{
+	if (b->buf)
+		_store_u32(b->buf + off, value, b->format);
+}
+
+static inline int _varint_len(uint64_t value)
+{
+	int size;
+
+	for (size = 1; value > 0x7f; value >>= 7)
+		size++;
+
+	return size;
+}
+
+static inline void _put_varint(struct serial_buffer *b, uint64_t value)
+{
+	for (; value > 0x7f; value >>= 7)
+		_put_u8(b, (value & 0x7f) | 0x80);
+
+	_put_u8(b, value);
+}
+
+/*
+ * compact tags of a string or container type, the tag carrying short
+ * lengths/counts (or -1) and the tag followed by a varint.
+ */
+static inline void _compact_tags(int type, int *small, int *tag)
+{
+	switch (type) {
+	case TYPE_STRING:
+		*small = COMPACT_STRING;
+		*tag   = COMPACT_STRING_N;
+		break;
+	case TYPE_UTF8:
+		*small = COMPACT_UTF8;
+		*tag   = COMPACT_UTF8_N;
+		break;
+	case TYPE_LIST:
+		*small = COMPACT_LIST;
+		*tag   = COMPACT_LIST_N;
+		break;
+	case TYPE_DICT:
+		*small = COMPACT_DICT;
+		*tag   = COMPACT_DICT_N;
+		break;
+	case TYPE_TUPLE:
+		*small = -1;
+		*tag   = COMPACT_TUPLE_N;
+		break;
+	case TYPE_LONGER:
+		*small = -1;
+		*tag   = COMPACT_LONGER;
+		break;
+	case TYPE_ARRAY:
+		*small = -1;
+		*tag   = COMPACT_ARRAY;
+		break;
+	case TYPE_NDARRAY:
+		*small = -1;
+		*tag   = COMPACT_NDARRAY;
+		break;
+	case TYPE_EXT:
+		*small = -1;
+		*tag   = COMPACT_EXT;
+		break;
+	case TYPE_SET:
+		*small = -1;
+		*tag   = COMPACT_SET_N;
+		break;
+	case TYPE_FROZENSET:
+		*small = -1;
+		*tag   = COMPACT_FROZENSET_N;
+		break;
+	case TYPE_DECIMAL:
+		*small = -1;
+		*tag   = COMPACT_DECIMAL;
+		break;
+	case TYPE_REF:
+		*small = -1;
+		*tag   = COMPACT_REF;
+		break;
+	case TYPE_SYMBOL:
+		*small = -1;
+		*tag   = COMPACT_SYMBOL;
+		break;
+	case TYPE_RECORD:
+		*small = -1;
+		*tag   = COMPACT_RECORD;
+		break;
+	default:
+		*small = -1;
+		*tag   = COMPACT_PICKLE;
+		break;
+	}
+}
+
+static inline int _compact_short(int small, uint32_t size)
+{
+	if (0 > small)
+		return 0;
+
+	return size <= (small == COMPACT_STRING ? 0x1f : 0x0f);
+}
+
+static int _compact_head_len(int type, uint32_t size)
+{
+	int small;
+	int tag;
+
+	_compact_tags(type, &small, &tag);
+	if (_compact_short(small, size))
+		return 0;
+
+	return _varint_len(size);
+}
+
+/*
+ * bytes following the type tag in the header of a string or container
+ * value of the given length or element count.
+ */
+static inline int _head_len(struct serial_buffer *b, int type, uint32_t size)
+{
+	if (b->format & FORMAT_COMPACT)
+		return _compact_head_len(type, size);
+
+	return sizeof(uint32_t);
+}
+
+static void _put_compact_head(struct serial_buffer *b, int type, uint32_t size)
+{
+	int small;
+	int tag;
+
+	_compact_tags(type, &small, &tag);
+	if (_compact_short(small, size)) {
+		_put_u8(b, small | size);
+		return;
+	}
+
+	_put_u8(b, tag);
+	_put_varint(b, size);
+}
+
+/*
+ * header of a string or container value, the type and its length or
+ * element count. space must be reserved with _head_len().
+ */
+static inline void _put_head(struct serial_buffer *b, int type, uint32_t size)
+{
+	if (b->format & FORMAT_COMPACT) {
+		_put_compact_head(b, type, size);
+		return;
+	}
+
+	_put_type(b, type);
+	_put_u32(b, size);
+}
+
+/*
+ * indexed payloads. space for a container's encoded length, and for
+ * larger lists/tuples an element offset table, is reserved after the
+ * element count and filled in as the elements are written.
+ */
+struct index_mark {
+	int length;	/* offset of the length field */
+	int table;	/* offset of the offset table, or -1 */
+	int first;	/* offset of the first element */
+};
+
+static int _index_begin
+(
+	struct serial_buffer *b,
+	struct index_mark *m,
+	int count,
+	int table
+)
+{
+	int size;
+	int result;
+
+	if (!(b->format & FORMAT_INDEXED))
+		return 0;
+
+	table = table && count >= INDEX_TABLE_MIN;
+	size  = sizeof(uint32_t) * (1 + (table ? count : 0));
+
+	result = _check_room(b, size);
+	if (result)
+		return result;
+
+	m->length = b->off;
+	m->table  = table ? m->length + sizeof(uint32_t) : -1;
+	m->first  = b->off + size;
+
+	b->off = m->first;
+	return 0;
+}
+
+static inline void _index_entry(struct serial_buffer *b, struct index_mark *m, int i)
+{
+	if (!(b->format & FORMAT_INDEXED) || 0 > m->table)
+		return;
+
+	_patch_u32(b, m->table + (i * sizeof(uint32_t)), b->off - m->first);
+}
+
+static inline void _index_end(struct serial_buffer *b, struct index_mark *m)
+{
+	if (!(b->format & FORMAT_INDEXED))
+		return;
+
+	_patch_u32(b, m->length, b->off - m->length - sizeof(uint32_t));
+}
+
+static int _put_ref(struct serial_buffer *b, int index)
+{
+	int result;
+
+	result = _check_size(b, _head_len(b, TYPE_REF, index));
+	if (result)
+		return result;
+
+	_put_head(b, TYPE_REF, index);
+	return 0;
+}
+
+/*
+ * write a dict key found in the symbol table as its index, returns
+ * -ENOENT if it is not a symbol.
+ */
+static int _put_symbol(struct serial_buffer *b, PyObject *key)
+{
+	PyObject *index;
+	long value;
+	int result;
+
+	if (!PyString_CheckExact(key))
+		return -ENOENT;
+
+	index = PyDict_GetItem(b->opts->symbols->index, key);
+	if (!index)
+		return -ENOENT;
+
+	value  = PyInt_AS_LONG(index);
+	result = _check_size(b, _head_len(b, TYPE_SYMBOL, value));
+	if (result)
+		return result;
+
+	_put_head(b, TYPE_SYMBOL, value);
+	return 0;
+}
+
+static inline struct ref_slot *_ref_slot(struct ref_table *r, PyObject *key)
+{
+	size_t i = (((uintptr_t)key >> 4) * 0x9e3779b1u) & r->mask;
+
+	while (r->slots[i].key && r->slots[i].key != key)
+		i = (i + 1) & r->mask;
+
+	return &r->slots[i];
+}
+
+
+static int _ref_grow(struct ref_table *r)
+{
+	struct ref_slot *slots;
+	struct ref_slot *slot;
+	int mask;
+	int i;
+
+	mask  = r->mask * 2 + 1;
+	slots = calloc(mask + 1, sizeof(struct ref_slot));
+	if (!slots) {
+		PyErr_NoMemory();
+		return -ENOMEM;
+	}
+
+	slot     = r->slots;
+	i        = r->mask;
+	r->slots = slots;
+	r->mask  = mask;
+
+	for (; i >= 0; i--)
+		if (slot[i].key)
+			*_ref_slot(r, slot[i].key) = slot[i];
+
+	free(slot);
+	return 0;
+}
+
+/*
+ * make input, written in full at index, available to back references.
+ * the table holds a reference, so that its address is not reused by a
+ * temporary (an extension encoder result) for the rest of the message.
+ */
+static int _ref_insert(struct serial_buffer *b, PyObject *input, int index)
+{
+	struct ref_table *r = b->refs;
+	struct ref_slot *slot;
+
+	if (r->used * 2 >= r->mask && _ref_grow(r))
+		return -ENOMEM;
+
+	slot = _ref_slot(r, input);
+	slot->key   = input;
+	slot->index = index;
+	r->used++;
+
+	Py_INCREF(input);
+	return 0;
+}
+
+/*
+ * encoding, containers and extension values by identity. returns 1
+ * once input has been written as a back reference, 0 if it is to be
+ * written in full. it is then indexed at once if early is set,
+ * otherwise index is the index to insert it at once written.
+ */
+static int _ref_object
+(
+	struct serial_buffer *b,
+	PyObject *input,
+	int *index,
+	int early
+)
+{
+	struct ref_slot *slot;
+	int result;
+
+	slot = _ref_slot(b->refs, input);
+	if (slot->key) {
+		result = _put_ref(b, slot->index);
+		if (result)
+			return result;
+
+		return 1;
+	}
+
+	*index = b->refs->count++;
+	if (!early)
+		return 0;
+
+	result = _ref_insert(b, input, *index);
+	*index = -1;
+	return result;
+}
+
+/*
+ * encoding, strings by content.
+ */
+static int _ref_lookup(struct serial_buffer *b, PyObject *input, int unicode)
+{
+	PyObject *table;
+	PyObject *index;
+	int result;
+
+	table = unicode ? b->refs->unicodes : b->refs->strings;
+
+	index = PyDict_GetItem(table, input);
+	if (index) {
+		result = _put_ref(b, PyInt_AS_LONG(index));
+		if (result)
+			return result;
+
+		return 1;
+	}
+
+	index = PyInt_FromLong(b->refs->count++);
+	if (!index)
+		return -ENOMEM;
+
+	result = PyDict_SetItem(table, input, index);
+	Py_DECREF(index);
+	if (result)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * size is the encoded length, which the decoder indexes by.
+ */
+static inline int _ref_string
+(
+	struct serial_buffer *b,
+	PyObject *input,
+	int size,
+	int unicode
+)
+{
+	if (!b->refs || size < REF_MIN_LEN)
+		return 0;
+
+	return _ref_lookup(b, input, unicode);
+}
+
+static int _copy_string
+(
+	struct serial_buffer *b,
+	const char *input_string,
+	int input_size,
+	short type
+)
+{
+	int result;
+	/*
+	 * large strings are written through to a stream sink rather than
+	 * grow the buffer beyond its high water mark.
+	 */
+	if (b->sink && input_size > (b->len / 2)) {
+		result = _check_size(b, _head_len(b, type, input_size));
+		if (result)
+			return result;
+
+		_put_head(b, type, input_size);
+
+		result = _flush(b);
+		if (result)
+			return result;
+
+		return _sink_write(b->sink, input_string, input_size);
+	}
+
+	result = _check_size(b, input_size + _head_len(b, type, input_size));
+	if (result)
+		return result;
+
+	_put_head(b, type, input_size);
+
+	_put_bytes(b, input_string, input_size);
+	return 0;
+}
+
+/*
+ * unicode is transcoded straight into the buffer once its encoded
+ * length, needed up front for the head, is known.
+ */
+static int _copy_unicode(struct serial_buffer *b, PyObject *input, short type)
+{
+	Py_UNICODE *data = PyUnicode_AS_UNICODE(input);
+	Py_ssize_t count = PyUnicode_GET_SIZE(input);
+	PyObject *value;
+	int result;
+	int size;
+
+	size = _utf8_len(data, count);
+
+	result = _ref_string(b, input, size, 1);
+	if (0 > result)
+		return result;
+	if (result)
+		return 0;
+
+	if (b->sink && size > (b->len / 2)) {
+		value = PyUnicode_AsUTF8String(input);
+		if (!value)
+			return -EINVAL;
+
+		result = _copy_string(b,
+				      PyString_AS_STRING(value),
+				      PyString_GET_SIZE(value),
+				      type);
+		Py_DECREF(value);
+		return result;
+	}
+
+	result = _check_size(b, size + _head_len(b, type, size));
+	if (result)
+		return result;
+
+	_put_head(b, type, size);
+
+	if (b->buf)
+		_utf8_encode(b->buf + b->off, data, count);
+
+	b->off += size;
+	return 0;
+}
+
+static int _check_whitelist(PyObject *input, struct serial_buffer *b)
+{
+	struct whitelist_entry *entry;
+
+	if (!b->opts->wls)
+		return 0;
+
+	for (entry = whitelist; entry->cls; entry++) {
+		if (PyObject_IsInstance(input, entry->cls))
+			return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int _serialize_object(PyObject *input, struct serial_buffer *b, int dp)
+{
+	char error_str[128];
+	PyObject *value;
+	int result = 0;
+
+	if (_check_whitelist(input, b)) {
+		sprintf(error_str, "Unlisted type: <%s>",
+			input->ob_type->tp_name);
+		PyErr_SetString(PyExc_TypeError, error_str);
+
+		result = -EINVAL;
+		goto err_dump;
+	}
+
+	value = PyObject_CallFunctionObjArgs(cpdumps, input, NULL);
+	if (!value) {
+		result = -EINVAL;
+		goto err_dump;
+	}
+
+	result = _copy_string(b,
+			      PyString_AS_STRING(value),
+			      PyString_GET_SIZE(value),
+			      TYPE_PICKLE);
+
+	Py_DECREF(value);
+err_dump:
+	return result;
+}
+
+static inline uint64_t _schema_sign(uint64_t sign, PyObject *key)
+{
+	long hash = ((PyStringObject *)key)->ob_shash;
+
+	if (hash == -1)
+		hash = PyObject_Hash(key);
+
+	return sign + (uint64_t)hash * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline int *_schema_slot(uint64_t sign)
+{
+	int i = (sign ^ (sign >> 32)) & (SCHEMA_SLOTS - 1);
+
+	while (schema_slots[i] && schemas[schema_slots[i] - 1].sign != sign)
+		i = (i + 1) & (SCHEMA_SLOTS - 1);
+
+	return schema_slots + i;
+}
+
+/*
+ * registered schema matching the keys, and value types, of dict input,
+ * -1 if there is none.
+ */
+static int _schema_match(PyObject *input)
+{
+	struct schema_entry *schema;
+	Py_ssize_t j = 0;
+	PyObject *value;
+	PyObject *type;
+	PyObject *key;
+	uint64_t sign = 0;
+	int id;
+	int i;
+
+	if (!schema_count || !PyDict_Size(input))
+		return -1;
+
+	while (PyDict_Next(input, &j, &key, &value)) {
+		if (!PyString_CheckExact(key))
+			return -1;
+
+		sign = _schema_sign(sign, key);
+	}
+
+	id = *_schema_slot(sign) - 1;
+	if (0 > id)
+		return -1;
+
+	schema = &schemas[id];
+	if (PyTuple_GET_SIZE(schema->fields) != PyDict_Size(input))
+		return -1;
+
+	for (i = 0, j = 0; PyDict_Next(input, &j, &key, &value); i++) {
+		if (key != PyTuple_GET_ITEM(schema->fields, schema->order[i])) {
+			type = PyDict_GetItem(schema->index, key);
+			if (!type)
+				return -1;
+
+			schema->order[i] = PyInt_AS_LONG(type);
+		}
+
+		if (!schema->types)
+			continue;
+
+		type = PyTuple_GET_ITEM(schema->types, schema->order[i]);
+		if (Py_None != type &&
+		    !PyObject_TypeCheck(value, (PyTypeObject *)type))
+			return -1;
+	}
+
+	return id;
+}
+
+/*
+ * registered extension tag for the class of input, or any of its
+ * bases, -1 if there is none.
+ */
+static int _ext_lookup(PyObject *input)
+{
+	PyObject *mro = Py_TYPE(input)->tp_mro;
+	PyObject *tag;
+	Py_ssize_t i;
+
+	if (!PyDict_Size(ext_classes) || !mro)
+		return -1;
+
+	for (i = 0; i < PyTuple_GET_SIZE(mro); i++) {
+		tag = PyDict_GetItem(ext_classes, PyTuple_GET_ITEM(mro, i));
+		if (tag)
+			return PyInt_AS_LONG(tag);
+	}
+
+	return -1;
+}
+
+/*
+ * compact payloads, ints of up to 64 bits.
+ */
+static int _serialize_int(long long item, struct serial_buffer *b)
+{
+	uint64_t value = ((uint64_t)item << 1) ^ (uint64_t)(item >> 63);
+	int result;
+
+	if ((item >= 0 && item < COMPACT_STRING) ||
+	    (item < 0 && item >= (COMPACT_NEGINT - 0x100))) {
+		result = _check_size(b, 0);
+		if (result)
+			return result;
+
+		_put_u8(b, item & 0xff);
+		return 0;
+	}
+
+	result = _check_size(b, _varint_len(value));
+	if (result)
+		return result;
+
+	_put_u8(b, COMPACT_INT);
+	_put_varint(b, value);
+	return 0;
+}
+
+static int _serialize_datetime(PyObject *input, struct serial_buffer *b)
+{
+	long long usec;
+	uint64_t value;
+	int result;
+
+	usec = _days_from_civil(PyDateTime_GET_YEAR(input),
+				PyDateTime_GET_MONTH(input),
+				PyDateTime_GET_DAY(input)) * USEC_PER_DAY;
+	usec += ((PyDateTime_DATE_GET_HOUR(input) * 60LL +
+		  PyDateTime_DATE_GET_MINUTE(input)) * 60 +
+		 PyDateTime_DATE_GET_SECOND(input)) * 1000000 +
+		PyDateTime_DATE_GET_MICROSECOND(input);
+
+	if (b->format & FORMAT_COMPACT) {
+		value = ((uint64_t)usec << 1) ^ (uint64_t)(usec >> 63);
+
+		result = _check_size(b, _varint_len(value));
+		if (result)
+			return result;
+
+		_put_u8(b, COMPACT_DATETIME);
+		_put_varint(b, value);
+		return 0;
+	}
+
+	result = _check_size(b, sizeof(uint64_t));
+	if (result)
+		return result;
+
+	_put_type(b, TYPE_DATETIME);
+	_put_u64(b, usec);
+	return 0;
+}
+
+/*
+ * compact payloads, floats as float32 when that loses nothing.
+ */
+static int _serialize_float(double value, struct serial_buffer *b)
+{
+	float narrow = (float)value;
+	uint32_t single;
+	uint64_t wide;
+	int result;
+
+	if ((double)narrow == value) {
+		result = _check_size(b, sizeof(float));
+		if (result)
+			return result;
+
+		memcpy(&single, &narrow, sizeof(single));
+		_put_u8(b, COMPACT_FLOAT);
+		_put_u32(b, single);
+	} else {
+		result = _check_size(b, sizeof(double));
+		if (result)
+			return result;
+
+		memcpy(&wide, &value, sizeof(wide));
+		_put_u8(b, COMPACT_DOUBLE);
+		_put_u64(b, wide);
+	}
+
+	return 0;
+}
+
+/*
+ * packed array kind for the items of a list or tuple, or 0 if they
+ * are not all plain ints or all floats. compact payloads only pack
+ * when that is no larger than the individual values.
+ */
+static int _array_kind
+(
+	PyObject **items,
+	Py_ssize_t count,
+	struct serial_buffer *b
+)
+{
+	long low = 0;
+	long high = 0;
+	long value;
+	double number;
+	Py_ssize_t size = 0;
+	Py_ssize_t i;
+	int kind;
+
+	if (!b->opts->packed || count < ARRAY_MIN || count > INT_MAX / 16)
+		return 0;
+
+	if (PyFloat_CheckExact(items[0])) {
+		for (i = 0; i < count; i++) {
+			if (!PyFloat_CheckExact(items[i]))
+				return 0;
+
+			number = PyFloat_AS_DOUBLE(items[i]);
+			size += ((double)(float)number == number) ?
+				1 + sizeof(float) : 1 + sizeof(double);
+		}
+
+		kind = ARRAY_DOUBLE;
+	} else if (PyInt_CheckExact(items[0])) {
+		for (i = 0; i < count; i++) {
+			if (!PyInt_CheckExact(items[i]))
+				return 0;
+
+			value = PyInt_AS_LONG(items[i]);
+			low   = MIN(low, value);
+			high  = MAX(high, value);
+			size += (value < COMPACT_STRING &&
+				 value >= (COMPACT_NEGINT - 0x100)) ? 1 :
+				1 + _varint_len(((uint64_t)value << 1) ^
+						(uint64_t)(value >> 63));
+		}
+
+		kind = (low >= INT_MIN && high <= INT_MAX) ?
+			ARRAY_INT32 : ARRAY_INT64;
+	} else
+		return 0;
+
+	if ((b->format & FORMAT_COMPACT) && size < count * _array_width(kind))
+		return 0;
+
+	return kind;
+}
+
+static void _array_fill
+(
+	char *data,
+	PyObject **items,
+	Py_ssize_t count,
+	int kind,
+	int format
+)
+{
+	Py_ssize_t i;
+
+	switch (kind) {
+	case ARRAY_INT32:
+		for (i = 0; i < count; i++)
+			((int32_t *)data)[i] = PyInt_AS_LONG(items[i]);
+		break;
+	case ARRAY_INT64:
+		for (i = 0; i < count; i++)
+			((int64_t *)data)[i] = PyInt_AS_LONG(items[i]);
+		break;
+	default:
+		for (i = 0; i < count; i++)
+			((double *)data)[i] = PyFloat_AS_DOUBLE(items[i]);
+		break;
+	}
+
+	if (!_swapped(format))
+		return;
+
+	if (kind == ARRAY_INT32)
+		_swap_u32(data, data, count);
+	else
+		_swap_u64(data, data, count);
+}
+
+static int _serialize_array(PyObject *input, int kind, struct serial_buffer *b)
+{
+	PyObject **items = PySequence_Fast_ITEMS(input);
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(input);
+	int width = _array_width(kind);
+	Py_ssize_t size;
+	Py_ssize_t n;
+	int result;
+	/*
+	 * large arrays are written out to a stream sink in pieces rather
+	 * than grow the buffer beyond its high water mark.
+	 */
+	size = count * width;
+	if (b->sink && size > (b->len / 2))
+		size = 0;
+
+	result = _check_size(b, _head_len(b, TYPE_ARRAY, count) +
+			     sizeof(uint8_t) + size);
+	if (result)
+		return result;
+
+	_put_head(b, TYPE_ARRAY, count);
+	_put_u8(b, kind | (PyTuple_Check(input) ? ARRAY_TUPLE : 0));
+
+	if (!b->buf) {
+		b->off += count * width;
+		return 0;
+	}
+
+	while (count) {
+		n = MIN(count, (b->len - b->off) / width);
+		if (!n) {
+			result = _flush(b);
+			if (result)
+				return result;
+			continue;
+		}
+
+		_array_fill(b->buf + b->off, items, n, kind, b->format);
+
+		b->off += n * width;
+		items  += n;
+		count  -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * numpy arrays of plain (not object or record) dtypes, encoded as
+ * their dtype, shape, strides and raw data. arrays whose data is not
+ * contiguous are copied into a C order array first, otherwise C or
+ * Fortran order is kept as is.
+ */
+static int _ndarray_check(PyObject *input, struct serial_buffer *b)
+{
+	PyObject *hasobject;
+	PyObject *fields;
+	PyObject *dtype;
+	int result = -EINVAL;
+
+	if (!b->opts->ndarray || !ndarray_type ||
+	    !PyObject_TypeCheck(input, (PyTypeObject *)ndarray_type))
+		return 0;
+
+	dtype = PyObject_GetAttrString(input, "dtype");
+	if (!dtype)
+		return -EINVAL;
+
+	hasobject = PyObject_GetAttrString(dtype, "hasobject");
+	fields    = PyObject_GetAttrString(dtype, "fields");
+	if (hasobject && fields)
+		result = !PyObject_IsTrue(hasobject) && fields == Py_None;
+
+	Py_XDECREF(hasobject);
+	Py_XDECREF(fields);
+	Py_DECREF(dtype);
+	return result;
+}
+
+static int _serialize_ndarray(PyObject *input, struct serial_buffer *b)
+{
+	PyObject *array;
+	PyObject *dtype;
+	PyObject *descr = NULL;
+	Py_buffer view;
+	Py_ssize_t step;
+	int result = -EINVAL;
+	int sink;
+	int meta;
+	int i;
+
+	if (!PyObject_GetBuffer(input, &view, PyBUF_ANY_CONTIGUOUS)) {
+		Py_INCREF(input);
+		array = input;
+	} else {
+		PyErr_Clear();
+
+		array = PyObject_CallMethod(numpy, "ascontiguousarray", "O",
+					    input);
+		if (!array)
+			return -EINVAL;
+
+		if (PyObject_GetBuffer(array, &view, PyBUF_ANY_CONTIGUOUS))
+			goto err_buffer;
+	}
+
+	dtype = PyObject_GetAttrString(array, "dtype");
+	if (dtype) {
+		descr = PyObject_GetAttrString(dtype, "str");
+		Py_DECREF(dtype);
+	}
+	if (!descr)
+		goto err_descr;
+
+	if (!PyString_Check(descr) || PyString_GET_SIZE(descr) > 0xff ||
+	    view.ndim > 0xff) {
+		PyErr_Format(PyExc_TypeError, "Unhandled array: <%s>",
+			     input->ob_type->tp_name);
+		goto err_meta;
+	}
+
+	meta = sizeof(uint8_t) * 2 + PyString_GET_SIZE(descr) +
+		view.ndim * 2 * sizeof(uint64_t);
+
+	if (view.len > (INT_MAX / 2 - meta)) {
+		PyErr_Format(PyExc_ValueError, "array too large <%zd>",
+			     view.len);
+		goto err_meta;
+	}
+	/*
+	 * as for strings, large data is written through to a stream sink.
+	 */
+	sink = b->sink && view.len > (b->len / 2);
+
+	result = _check_size(b, _head_len(b, TYPE_NDARRAY, meta + view.len) +
+			     meta + (sink ? 0 : view.len));
+	if (result)
+		goto err_meta;
+
+	_put_head(b, TYPE_NDARRAY, meta + view.len);
+	_put_u8(b, PyString_GET_SIZE(descr));
+	_put_bytes(b, PyString_AS_STRING(descr), PyString_GET_SIZE(descr));
+	_put_u8(b, view.ndim);
+
+	for (i = 0; i < view.ndim; i++)
+		_put_u64(b, view.shape[i]);
+	/*
+	 * exporters may leave out the strides of C order data.
+	 */
+	for (i = 0; i < view.ndim; i++) {
+		if (view.strides)
+			step = view.strides[i];
+		else
+			for (step = view.itemsize, result = i + 1;
+			     result < view.ndim; result++)
+				step *= view.shape[result];
+
+		_put_u64(b, step);
+	}
+
+	if (sink) {
+		result = _flush(b);
+		if (!result)
+			result = _sink_write(b->sink, view.buf, view.len);
+		goto err_meta;
+	}
+
+	_put_bytes(b, view.buf, view.len);
+	result = 0;
+err_meta:
+	Py_DECREF(descr);
+err_descr:
+	PyBuffer_Release(&view);
+err_buffer:
+	Py_DECREF(array);
+	return result;
+}
+
+struct encode_frame {
+	PyObject *input;	/* container being encoded */
+	PyObject *value;	/* dict value awaiting its key, or ext value */
+	PyObject *fields;	/* record field names */
+	struct index_mark mark;
+	int size;		/* element count written to the header */
+	Py_ssize_t pos;		/* next element, or dict/set position */
+	int type;
+	int index;		/* back reference inserted once complete, or -1 */
+};
+
+struct encode_stack {
+	int depth;
+	int room;
+	struct encode_frame *frames;
+	struct encode_frame *local;
+};
+
+static void _encode_init
+(
+	struct encode_stack *s,
+	struct encode_frame *local,
+	int room
+)
+{
+	s->depth  = 0;
+	s->room   = room;
+	s->frames = local;
+	s->local  = local;
+}
+
+static inline void _encode_clear(struct encode_frame *f)
+{
+	Py_CLEAR(f->input);
+	Py_CLEAR(f->value);
+	Py_CLEAR(f->fields);
+}
+
+static void _encode_free(struct encode_stack *s)
+{
+	while (s->depth)
+		_encode_clear(&s->frames[--s->depth]);
+
+	if (s->frames != s->local)
+		free(s->frames);
+
+	s->frames = s->local;
+}
+
+static inline struct encode_frame *_encode_push
+(
+	struct encode_stack *s,
+	int type,
+	PyObject *input,
+	int index
+)
+{
+	struct encode_frame *f;
+	int want;
+
+	if (s->depth == s->room) {
+		want = MAX(ENGINE_LOCAL_DEPTH, s->room * 2);
+		f = _stack_grow(s->frames, s->local, s->room, want,
+				sizeof(*f));
+		if (!f)
 			return NULL;
+
+		s->frames = f;
+		s->room   = want;
+	}
+
+	f = &s->frames[s->depth++];
+
+	Py_INCREF(input);
+	f->input  = input;
+	f->value  = NULL;
+	f->fields = NULL;
+	f->size   = 0;
+	f->pos    = 0;
+	f->type   = type;
+	f->index  = index;
+	return f;
+}
+
+/*
+ * open a container whose header has been written. an empty one is
+ * complete at once and gets no frame.
+ */
+static inline int _encode_open
+(
+	struct serial_buffer *b,
+	struct encode_stack *s,
+	int type,
+	PyObject *input,
+	int index,
+	int count,
+	int table
+)
+{
+	struct encode_frame *f;
+	int result;
+
+	if (count) {
+		f = _encode_push(s, type, input, index);
+		if (!f)
+			return -ENOMEM;
+
+		f->size = count;
+		return _index_begin(b, &f->mark, count, table);
+	}
+
+	if (b->format & FORMAT_INDEXED) {
+		result = _check_room(b, sizeof(uint32_t));
+		if (result)
+			return result;
+
+		_put_u32(b, 0);
+	}
+
+	if (0 <= index)
+		return _ref_insert(b, input, index);
+
+	return 0;
+}
+
+/*
+ * encode one value. a leaf is written whole, for a container its header
+ * is written and a frame pushed, which the engine loop then walks.
+ */
+static int _serialize_value
+(
+	PyObject *input,
+	struct serial_buffer *b,
+	struct encode_stack *s
+)
+{
+	struct encode_frame *f;
+	PyObject *value;
+	long i;
+	long long item;
+	uint32_t arg;
+	int index = -1;
+	int result;
+	int kind;
+
+	if (b->opts->max_depth < s->depth) {
+		PyErr_Format(PyExc_SystemError, 
+			     "max recursion depth <%d> exceeded",
+			     b->opts->max_depth);
+		return -EINVAL;
+	}
+
+	if (!input) {
+		PyErr_SetString(PyExc_SystemError, "missing input object");
+		return -EINVAL;
+	}
+
+	if (b->func) {
+		result = _check_yield(b);
+		if (result)
+			return result;
+	}
+
+	if (PyInt_Check(input)) {
+		if (PyBool_Check(input) && b->opts->extended) {
+			result = _check_size(b, (b->format & FORMAT_COMPACT) ?
+					     0 : sizeof(uint8_t));
+			if (result)
+				return result;
+
+			if (b->format & FORMAT_COMPACT)
+				_put_u8(b, Py_True == input ?
+					COMPACT_TRUE : COMPACT_FALSE);
+			else {
+				_put_type(b, TYPE_BOOL);
+				_put_u8(b, Py_True == input);
+			}
+
+			goto done;
+		}
+
+		item = PyInt_AS_LONG(input);
+
+		if (b->format & FORMAT_COMPACT) {
+			result = _serialize_int(item, b);
+			if (result)
+				return result;
+
+			goto done;
+		}
+
+		if (item > INT_MAX || item < INT_MIN) {
+			result = _check_size(b, sizeof(uint64_t));
+			if (result)
+				return result;
+
+			_put_type(b, TYPE_LONG);
+			_put_u64(b, item);
+
+			goto done;
+		}
+		else {
+			result = _check_size(b, sizeof(uint32_t));
+			if (result)
+				return result;
+
+			_put_type(b, TYPE_INT);
+			_put_u32(b, item);
+
+			goto done;
+		}
+	}
+
+	if (PyLong_Check(input)) {
+		item = PyLong_AsLongLong(input);
+		if (item == -1 && PyErr_Occurred()) {
+			PyErr_Clear();
+
+			i = _PyLong_NumBits(input) + 1; /* include sign bit */
+			i = i/8 + MIN(i%8, 1); /* byte count rounded up */
+
+			result = _check_size(b, _head_len(b, TYPE_LONGER, i) + i);
+			if (result)
+				return result;
+
+			_put_head(b, TYPE_LONGER, i);
+
+			result = !b->buf ? 0 : _PyLong_AsByteArray(
+				(PyLongObject *)input,
+				(unsigned char *)(b->buf + b->off),
+				(size_t)i, 0, 1);
+			if (result)
+				return result;
+
+			b->off += i;
+			goto done;
+		}
+		else if (b->format & FORMAT_COMPACT) {
+			result = _serialize_int(item, b);
+			if (result)
+				return result;
+
+			goto done;
+		}
+		else {
+			result = _check_size(b, sizeof(uint64_t));
+			if (result)
+				return result;
+
+			_put_type(b, TYPE_LONG);
+			_put_u64(b, item);
+
+			goto done;
+		}
+	}
+
+	if (PyString_Check(input)) {
+		result = _ref_string(b, input, PyString_GET_SIZE(input), 0);
+		if (0 > result)
+			return result;
+		if (result)
+			goto done;
+
+		result = _copy_string(b,
+				      PyString_AS_STRING(input),
+				      PyString_GET_SIZE(input),
+				      TYPE_STRING);
+		if (result)
+			return result;
+
+		goto done;
+	}
+
+	if (PyUnicode_Check(input)) {
+		result = _copy_unicode(b,
+				       input,
+				       b->opts->utf8 ? TYPE_UTF8 : TYPE_STRING);
+		if (result)
+			return result;
+
+		goto done;
+	}
+
+	if (PyList_Check(input)) {
+		if (b->refs) {
+			result = _ref_object(b, input, &index, 1);
+			if (0 > result)
+				return result;
+			if (result)
+				goto done;
+		}
+
+		kind = _array_kind(PySequence_Fast_ITEMS(input),
+				   PyList_GET_SIZE(input), b);
+		if (kind) {
+			result = _serialize_array(input, kind, b);
+			if (result)
+				return result;
+
+			goto done;
+		}
+
+		result = _check_size(b, _head_len(b, TYPE_LIST,
+						  PyList_GET_SIZE(input)));
+		if (result)
+			return result;
+
+		_put_head(b, TYPE_LIST, PyList_GET_SIZE(input));
+
+		return _encode_open(b, s, TYPE_LIST, input, -1,
+				    PyList_GET_SIZE(input), 1);
+	}
+
+	if (PyDict_Check(input)) {
+		if (b->refs) {
+			result = _ref_object(b, input, &index, 1);
+			if (0 > result)
+				return result;
+			if (result)
+				goto done;
+		}
+
+		kind = b->opts->schemas ? _schema_match(input) : -1;
+		if (0 <= kind) {
+			arg  = kind | schemas[kind].check << SCHEMA_CHECK_SHIFT;
+
+			result = _check_size(b, _head_len(b, TYPE_RECORD, arg));
+			if (result)
+				return result;
+
+			_put_head(b, TYPE_RECORD, arg);
+
+			f = _encode_push(s, TYPE_RECORD, input, -1);
+			if (!f)
+				return -ENOMEM;
+			/*
+			 * held across the nested encode, which may register
+			 * the schema again.
+			 */
+			f->fields = schemas[kind].fields;
+			Py_INCREF(f->fields);
+
+			return _index_begin(b, &f->mark, 0, 0);
+		}
+
+		result = _check_size(b, _head_len(b, TYPE_DICT,
+						  PyDict_Size(input)));
+		if (result)
+			return result;
+
+		_put_head(b, TYPE_DICT, PyDict_Size(input));
+
+		return _encode_open(b, s, TYPE_DICT, input, -1,
+				    PyDict_Size(input), 0);
+	}
+
+	if (Py_None == input) {
+		result = _check_size(b, 0);
+		if (result)
+			return result;
+
+		if (b->format & FORMAT_COMPACT)
+			_put_u8(b, COMPACT_NULL);
+		else
+			_put_type(b, TYPE_NULL);
+
+		goto done;
+	}
+
+	if (PyFloat_Check(input)) {
+		if (b->format & FORMAT_COMPACT) {
+			result = _serialize_float(PyFloat_AS_DOUBLE(input), b);
+			if (result)
+				return result;
+
+			goto done;
+		}
+
+		result = _check_size(b, sizeof(double));
+		if (result)
+			return result;
+
+		_put_type(b, TYPE_DOUBLE);
+		_put_double(b, PyFloat_AS_DOUBLE(input));
+
+		goto done;
+	}
+
+	if (PyTuple_Check(input)) {
+		if (b->refs) {
+			result = _ref_object(b, input, &index, 0);
+			if (0 > result)
+				return result;
+			if (result)
+				goto done;
+		}
+
+		kind = _array_kind(PySequence_Fast_ITEMS(input),
+				   PyTuple_GET_SIZE(input), b);
+		if (kind) {
+			result = _serialize_array(input, kind, b);
+			if (result)
+				return result;
+
+			if (0 <= index) {
+				result = _ref_insert(b, input, index);
+				if (result)
+					return result;
+			}
+
+			goto done;
+		}
+
+		result = _check_size(b, _head_len(b, TYPE_TUPLE,
+						  PyTuple_GET_SIZE(input)));
+		if (result)
+			return result;
+
+		_put_head(b, TYPE_TUPLE, PyTuple_GET_SIZE(input));
+
+		return _encode_open(b, s, TYPE_TUPLE, input, index,
+				    PyTuple_GET_SIZE(input), 1);
+	}
+
+	if (b->opts->extended && PyAnySet_Check(input)) {
+		kind = PyFrozenSet_Check(input) ? TYPE_FROZENSET : TYPE_SET;
+
+		if (b->refs) {
+			result = _ref_object(b, input, &index,
+					     kind == TYPE_SET);
+			if (0 > result)
+				return result;
+			if (result)
+				goto done;
+		}
+
+		result = _check_size(b, _head_len(b, kind,
+						  PySet_GET_SIZE(input)));
+		if (result)
+			return result;
+
+		_put_head(b, kind, PySet_GET_SIZE(input));
+
+		return _encode_open(b, s, kind, input, index,
+				    PySet_GET_SIZE(input), 0);
+	}
+
+	if (b->opts->extended && PyDateTimeAPI &&
+	    PyDateTime_CheckExact(input) &&
+	    !((PyDateTime_DateTime *)input)->hastzinfo) {
+		result = _serialize_datetime(input, b);
+		if (result)
+			return result;
+
+		goto done;
+	}
+
+	if (b->opts->extended && decimal_type &&
+	    (PyObject *)Py_TYPE(input) == decimal_type) {
+		value = PyObject_Str(input);
+		if (!value)
+			return -EINVAL;
+
+		result = _copy_string(b,
+				      PyString_AS_STRING(value),
+				      PyString_GET_SIZE(value),
+				      TYPE_DECIMAL);
+		Py_DECREF(value);
+		if (result)
+			return result;
+
+		goto done;
+	}
+
+	result = _ndarray_check(input, b);
+	if (0 > result)
+		return result;
+
+	if (result) {
+		result = _serialize_ndarray(input, b);
+		if (result)
+			return result;
+
+		goto done;
+	}
+
+	kind = _ext_lookup(input);
+	if (0 <= kind) {
+		if (b->refs) {
+			result = _ref_object(b, input, &index, 0);
+			if (0 > result)
+				return result;
+			if (result)
+				goto done;
+		}
+
+		value = PyObject_CallFunctionObjArgs(ext_types[kind].encode,
+						     input, NULL);
+		if (!value)
+			return -EINVAL;
+
+		result = _check_size(b, _head_len(b, TYPE_EXT, kind));
+		if (!result) {
+			_put_head(b, TYPE_EXT, kind);
+
+			f = _encode_push(s, TYPE_EXT, input, index);
+			if (!f)
+				result = -ENOMEM;
+		}
+
+		if (result) {
+			Py_DECREF(value);
+			return result;
+		}
+
+		f->value = value;
+		return 0;
+	}
+
+	if (cpdumps) {
+		result = _serialize_object(input, b, s->depth);
+		if (result)
+			return result;
+
+		goto done;
+	}
+
+	PyErr_Format(PyExc_TypeError, "Unhandled type: <%s>",
+		     input->ob_type->tp_name);
+	return -EINVAL;
+done:
+	return 0;
+}
+
+/*
+ * encode engine, the counterpart of _decode_run. each type has its own
+ * inner loop over the members of the innermost open container, left
+ * at the stop offset of a stepped encode. a container is only closed
+ * once its loop ends for lack of members, so resuming one that was in
+ * fact complete merely closes it.
+ */
+static int _encode_run(struct serial_buffer *b, struct encode_stack *s)
+{
+	struct encode_frame *f;
+	PyObject *input;
+	PyObject *held;
+	PyObject *value;
+	PyObject *key;
+	long hash;
+	int result = 0;
+	int depth;
+	int stop;
+
+	stop = b->stop ? b->stop : INT_MAX;
+
+	while (!result && s->depth) {
+		if (b->off >= stop) {
+			if (_step_expired(b))
+				return -EAGAIN;
+
+			stop = b->stop;
+		}
+
+		depth = s->depth;
+		f = &s->frames[depth - 1];
+		/*
+		 * encode elements in place until one opens a container of its
+		 * own, f is stale once the stack has grown.
+		 */
+		switch (f->type) {
+		case TYPE_LIST:
+		case TYPE_TUPLE:
+			while (!result && s->depth == depth &&
+			       b->off < stop &&
+			       f->pos < PySequence_Fast_GET_SIZE(f->input)) {
+				_index_entry(b, &f->mark, f->pos);
+				input  = PySequence_Fast_GET_ITEM(f->input,
+								  f->pos++);
+				result = _serialize_value(input, b, s);
+			}
+			break;
+		case TYPE_DICT:
+			/*
+			 * the value of a key which opened a container.
+			 */
+			if (f->value) {
+				held = f->value;
+				f->value = NULL;
+
+				result = _serialize_value(held, b, s);
+				Py_DECREF(held);
+			}
+
+			while (!result && s->depth == depth &&
+			       b->off < stop &&
+			       PyDict_Next(f->input, &f->pos, &key, &value)) {
+				result = -ENOENT;
+				if (b->opts->symbols)
+					result = _put_symbol(b, key);
+				if (result == -ENOENT)
+					result = _serialize_value(key, b, s);
+				if (result)
+					break;
+
+				if (s->depth == depth) {
+					result = _serialize_value(value, b, s);
+					continue;
+				}
+
+				Py_INCREF(value);
+				s->frames[depth - 1].value = value;
+			}
+			break;
+		case TYPE_RECORD:
+			while (!result && s->depth == depth &&
+			       b->off < stop &&
+			       f->pos < PyTuple_GET_SIZE(f->fields)) {
+				key    = PyTuple_GET_ITEM(f->fields, f->pos++);
+				result = _serialize_value(PyDict_GetItem(f->input,
+									 key),
+							  b, s);
+			}
+			break;
+		case TYPE_SET:
+		case TYPE_FROZENSET:
+			while (!result && s->depth == depth &&
+			       b->off < stop &&
+			       _PySet_NextEntry(f->input, &f->pos, &key, &hash))
+				result = _serialize_value(key, b, s);
+			break;
+		case TYPE_EXT:
+			if (!f->pos++)
+				result = _serialize_value(f->value, b, s);
+			break;
+		}
+
+		if (result || s->depth != depth || b->off >= stop)
+			continue;
+
+		if (f->type != TYPE_EXT)
+			_index_end(b, &f->mark);
+		if (0 <= f->index)
+			result = _ref_insert(b, f->input, f->index);
+
+		_encode_clear(f);
+		s->depth--;
+	}
+
+	return result;
+}
+
+static int _serialize(PyObject *input, struct serial_buffer *b)
+{
+	struct encode_frame local[ENGINE_LOCAL_DEPTH];
+	struct encode_stack stack;
+	int result;
+
+	if (!b) {
+		PyErr_SetString(PyExc_SystemError, "missing buffer object");
+		return -EINVAL;
+	}
+
+	_encode_init(&stack, local, ENGINE_LOCAL_DEPTH);
+
+	result = _serialize_value(input, b, &stack);
+	if (!result)
+		result = _encode_run(b, &stack);
+
+	_encode_free(&stack);
+	return result;
+}
+
+
+
+/*
+ * keyword names of the per-object options accepted by the Codec,
+ * Decoder and Encoder constructors.
+ */
+struct option_entry {
+	char *name;
+	int   offset;
+};
+
+static struct option_entry option_table[] = {
+	{"utf8",      offsetof(struct wbin_options, utf8)},
+	{"whitelist", offsetof(struct wbin_options, wls)},
+	{"max_depth", offsetof(struct wbin_options, max_depth)},
+	{"indexed",   offsetof(struct wbin_options, indexed)},
+	{"key_cache", offsetof(struct wbin_options, key_cache)},
+	{"cache_values", offsetof(struct wbin_options, cache_values)},
+	{"version",   offsetof(struct wbin_options, version)},
+	{"little_endian", offsetof(struct wbin_options, little_endian)},
+	{"packed",    offsetof(struct wbin_options, packed)},
+	{"ndarray",   offsetof(struct wbin_options, ndarray)},
+	{"extended",  offsetof(struct wbin_options, extended)},
+	{"refs",      offsetof(struct wbin_options, refs)},
+	{"schemas",   offsetof(struct wbin_options, schemas)},
+	{"compress",  offsetof(struct wbin_options, compress)},
+	{"checksum",  offsetof(struct wbin_options, checksum)},
+	{NULL, 0}
+};
+
+/*
+ * apply any option keywords found in kwds to opts. returns a new dict
+ * holding the remaining keywords, for the caller to parse itself.
+ */
+static PyObject *_options_split(struct wbin_options *opts, PyObject *kwds)
+{
+	struct option_entry *entry;
+	Py_ssize_t i = 0;
+	PyObject *output;
+	PyObject *value;
+	PyObject *key;
+	long number;
+
+	output = PyDict_New();
+	if (!output || !kwds)
+		return output;
+
+	while (PyDict_Next(kwds, &i, &key, &value)) {
+		for (entry = option_table; entry->name; entry++)
+			if (PyString_Check(key) &&
+			    !strcmp(PyString_AS_STRING(key), entry->name))
+				break;
+
+		if (!entry->name) {
+			if (PyDict_SetItem(output, key, value))
+				goto error;
+			continue;
+		}
+
+		number = PyInt_AsLong(value);
+		if (number == -1 && PyErr_Occurred())
+			goto error;
+
+		if (number > INT_MAX || number < INT_MIN) {
+			PyErr_Format(PyExc_OverflowError,
+				     "option '%s' out of range", entry->name);
+			goto error;
+		}
+
+		*(int *)((char *)opts + entry->offset) = (int)number;
+	}
+
+	return output;
+error:
+	Py_DECREF(output);
+	return NULL;
+}
+
+/*
+ * write the format header of a message, as far as it is known before
+ * the body is encoded.
+ */
+static int _serialize_header(struct serial_buffer *b)
+{
+	int result;
+
+	b->format = 0;
+	if (b->opts->indexed)
+		b->format |= FORMAT_INDEXED;
+	if (b->opts->little_endian)
+		b->format |= FORMAT_LE;
+	if (b->opts->refs)
+		b->format |= FORMAT_REFS;
+	if (b->opts->symbols)
+		b->format |= FORMAT_SYMBOLS;
+	if (b->opts->checksum && !b->sink)
+		b->format |= FORMAT_CRC;
+	/*
+	 * packed arrays, ndarrays, extension and extended types and
+	 * records are unknown to decoders predating them, which are made
+	 * to refuse the payload up front rather than partway through.
+	 */
+	if (b->opts->packed || b->opts->ndarray || b->opts->extended ||
+	    b->opts->schemas || PyDict_Size(ext_classes))
+		b->format |= FORMAT_TYPES;
+
+	switch (b->opts->version) {
+	case FORMAT_VERSION:
+		break;
+	case FORMAT_COMPACT_VERSION:
+		b->format |= FORMAT_COMPACT;
+		break;
+	default:
+		PyErr_Format(PyExc_ValueError,
+			     "Unsupported format version: <%d>",
+			     b->opts->version);
+		return -EINVAL;
+	}
+
+	/*
+	 * whether the body gets compressed is only known once it has been
+	 * encoded, the flag is set then.
+	 */
+	if (b->format || b->opts->compress) {
+		result = _check_room(b, FORMAT_HEADER_LEN +
+				     (b->format & FORMAT_SYMBOLS ?
+				      FORMAT_SYMBOLS_LEN : 0) +
+				     (b->format & FORMAT_CRC ?
+				      FORMAT_CRC_LEN : 0));
+		if (result)
+			return result;
+
+		_put_u8(b, FORMAT_MAGIC);
+		_put_u8(b, b->format & FORMAT_COMPACT ?
+			FORMAT_COMPACT_VERSION : FORMAT_VERSION);
+		_put_u8(b, b->format & FORMAT_FLAGS);
+		if (b->format & FORMAT_SYMBOLS)
+			_put_u32(b, b->opts->symbols->version);
+		/*
+		 * length and checksum are filled in by _frame_message()
+		 * once the body is complete.
+		 */
+		if (b->format & FORMAT_CRC) {
+			_put_u32(b, 0);
+			_put_u32(b, 0);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * encode one complete message, format header included.
+ */
+static int _serialize_message(PyObject *input, struct serial_buffer *b)
+{
+	struct ref_table refs;
+	int result;
+
+	result = _serialize_header(b);
+	if (result)
+		return result;
+
+	if (!(b->format & FORMAT_REFS))
+		return _serialize(input, b);
+
+	result = _ref_init(&refs, 1);
+	if (!result) {
+		b->refs = &refs;
+		result  = _serialize(input, b);
+		b->refs = NULL;
+	}
+
+	_ref_free(&refs);
+	return result;
+}
+
+static int _check_callable(PyObject *yield)
+{
+	if (yield && !PyCallable_Check(yield)) {
+		PyErr_Format(PyExc_TypeError,
+			     "'%s' object not callable",
+			     yield->ob_type->tp_name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int _scratch_acquire(struct scratch_buffer *s, struct serial_buffer *b)
+{
+	/*
+	 * a scratch buffer already in use further up the stack (a
+	 * callback or pickle hook serializing through the same codec)
+	 * is left alone, a private buffer is allocated instead.
+	 */
+	if (s && !s->busy && s->buf) {
+		b->buf  = s->buf;
+		b->len  = s->len;
+		s->busy = 1;
+		return 1;
+	}
+
+	b->len = INIT_BUFFER_LEN;
+	b->buf = malloc(b->len);
+	if (!b->buf) {
+		PyErr_Format(PyExc_MemoryError,
+			     "failed to allocate buffer <%d>", b->len);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void _scratch_release(struct scratch_buffer *s, struct serial_buffer *b)
+{
+	char *new;
+	int want;
+
+	s->buf  = b->buf;
+	s->len  = b->len;
+	s->busy = 0;
+	/*
+	 * track a decaying average of the encoded output size, and hand
+	 * memory back once the buffer has grown well beyond what recent
+	 * messages needed.
+	 */
+	s->avg += (b->off - s->avg) / 8;
+
+	for (want = s->min; want < (s->avg * 2) && want < (INT_MAX / 2); )
+		want *= 2;
+
+	if (s->len <= (want * 4))
+		return;
+
+	new = realloc(s->buf, want);
+	if (!new)
+		return;
+
+	s->buf = new;
+	s->len = want;
+}
+
+static int _encoded_size(PyObject *input, struct serial_buffer *b)
+{
+	PyObject *func = b->func;
+	int result;
+	/*
+	 * sizing pass, run the encoder w/o a buffer (and w/o the yield
+	 * callback) so that only the offset is advanced.
+	 */
+	b->buf  = NULL;
+	b->off  = 0;
+	b->func = NULL;
+
+	result = _serialize_message(input, b);
+	b->func = func;
+	if (result)
+		return -1;
+
+	return b->off;
+}
+
+/*
+ * compress the body of the message just encoded at offset start of the
+ * buffer, in place and w/o the GIL, if it is at least opts->compress
+ * bytes long and compresses enough to make up for the lengths.
+ */
+static int _compress_message(struct serial_buffer *b, int start)
+{
+	char *packed;
+	char *buf;
+	int format;
+	int head;
+	int size;
+	int result;
+
+	if (!b->opts->compress)
+		return 0;
+
+	buf  = b->buf + start;
+	head = _get_header(buf, b->off - start, &format);
+	if (0 >= head)
+		return head;
+
+	size = b->off - start - head;
+	if (size < b->opts->compress || size < FORMAT_LZ_LEN)
+		return 0;
+
+	packed = malloc(_lz_bound(size));
+	if (!packed) {
+		PyErr_NoMemory();
+		return -ENOMEM;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	result = _lz_compress(buf + head, size, packed);
+	Py_END_ALLOW_THREADS
+
+	if (result < size - FORMAT_LZ_LEN) {
+		buf[2] |= FORMAT_LZ;
+
+		_store_u32(buf + head, size, format);
+		_store_u32(buf + head + sizeof(uint32_t), result, format);
+		memcpy(buf + head + FORMAT_LZ_LEN, packed, result);
+
+		b->off = start + head + FORMAT_LZ_LEN + result;
+	}
+
+	free(packed);
+	return 0;
+}
+
+/*
+ * fill in the length and CRC32C of a framed message encoded at offset
+ * start of the buffer, the checksum covers everything but its own field.
+ */
+static void _frame_message(struct serial_buffer *b, int start)
+{
+	uint32_t crc;
+	char *frame;
+	char *buf;
+	int size;
+
+	if (!(b->format & FORMAT_CRC))
+		return;
+
+	buf   = b->buf + start;
+	frame = buf + FORMAT_HEADER_LEN;
+	if (b->format & FORMAT_SYMBOLS)
+		frame += FORMAT_SYMBOLS_LEN;
+
+	size = b->buf + b->off - (frame + FORMAT_CRC_LEN);
+	_store_u32(frame, size, b->format);
+
+	crc = _crc32c(0, buf, frame + sizeof(uint32_t) - buf);
+	crc = _crc32c(crc, frame + FORMAT_CRC_LEN, size);
+	_store_u32(frame + sizeof(uint32_t), crc, b->format);
+}
+
+static int _finish_message(struct serial_buffer *b, int start)
+{
+	int result;
+
+	result = _compress_message(b, start);
+	if (result)
+		return result;
+
+	_frame_message(b, start);
+	return 0;
+}
+
+static PyObject *_serialize_exact(PyObject *input, struct serial_buffer *b)
+{
+	PyObject *output;
+	int size;
+
+	size = _encoded_size(input, b);
+	if (0 > size)
+		return NULL;
+
+	output = PyString_FromStringAndSize(NULL, size);
+	if (!output)
+		return NULL;
+
+	b->buf   = PyString_AS_STRING(output);
+	b->len   = size;
+	b->off   = 0;
+	b->fixed = 1;
+
+	if (_serialize_message(input, b)) {
+		Py_DECREF(output);
+		return NULL;
+	}
+
+	if (b->off != size) {
+		PyErr_Format(PyExc_SystemError,
+			     "encoded size changed <%d> to <%d>",
+			     size, b->off);
+		Py_DECREF(output);
+		return NULL;
+	}
+
+	if (_finish_message(b, 0)) {
+		Py_DECREF(output);
+		return NULL;
+	}
+
+	if (b->off < size && _PyString_Resize(&output, b->off))
+		return NULL;
+
+	return output;
+}
+
+static PyObject *_serialize_call
+(
+	struct wbin_options *opts,
+	struct scratch_buffer *scratch,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"object", "callback", "args", "frequency",
+				 "exact", NULL};
+	struct serial_buffer buffer;
+	PyObject *input;
+	PyObject *output;
+	PyObject *yield = NULL;
+	PyObject *yargs = empty_tuple;
+	int length = DEFAULT_MAX_RUN;
+	int exact = 0;
+	int result;
+	int pooled;
+
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "O|OO!ii", kwlist,
+					     &input, &yield,
+					     &PyTuple_Type, &yargs,
+					     &length, &exact);
+	if (!result)
+		return NULL;
+
+	if (_check_callable(yield))
+		return NULL;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.func = yield;
+	buffer.size = length;
+	buffer.args = yargs;
+	buffer.opts = opts;
+
+	if (exact)
+		return _serialize_exact(input, &buffer);
+
+	pooled = _scratch_acquire(scratch, &buffer);
+	if (0 > pooled)
+		return NULL;
+
+	result = _serialize_message(input, &buffer);
+	if (!result)
+		result = _finish_message(&buffer, 0);
+	if (result)
+		output = NULL;
+	else
+		output = PyString_FromStringAndSize(buffer.buf, buffer.off);
+
+	if (pooled)
+		_scratch_release(scratch, &buffer);
+	else
+		free(buffer.buf);
+
+	return output;
+}
+
+static int _check_offset(Py_buffer *view, Py_ssize_t offset)
+{
+	if (offset < 0 || offset > view->len) {
+		PyErr_Format(PyExc_ValueError,
+			     "offset <%zd> outside buffer of <%zd>",
+			     offset, view->len);
+		return -EINVAL;
+	}
+
+	if ((view->len - offset) > INT_MAX) {
+		PyErr_Format(PyExc_ValueError,
+			     "buffer of <%zd> too large", view->len - offset);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static PyObject *_serialize_into_call
+(
+	struct wbin_options *opts,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"object", "buffer", "offset", NULL};
+	struct serial_buffer buffer;
+	Py_ssize_t offset = 0;
+	Py_buffer view;
+	PyObject *output = NULL;
+	PyObject *input;
+	PyObject *dest;
+	int result;
+	int size;
+
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "OO|n", kwlist,
+					     &input, &dest, &offset);
+	if (!result)
+		return NULL;
+
+	if (_get_buffer(dest, &view, 1))
+		return NULL;
+
+	if (_check_offset(&view, offset))
+		goto done;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.buf   = (char *)view.buf + offset;
+	buffer.len   = view.len - offset;
+	buffer.fixed = 1;
+	buffer.opts  = opts;
+
+	result = _serialize_message(input, &buffer);
+	if (!result)
+		result = _finish_message(&buffer, 0);
+	if (!result) {
+		output = PyInt_FromLong(buffer.off);
+		goto done;
+	}
+
+	if (result != -ENOSPC)
+		goto done;
+	/*
+	 * out of space, report the required size as the second exception
+	 * argument so the caller can grow the buffer and retry.
+	 */
+	PyErr_Clear();
+
+	size = _encoded_size(input, &buffer);
+	if (0 > size)
+		goto done;
+
+	output = Py_BuildValue("(si)", "insufficient buffer space", size);
+	if (output)
+		PyErr_SetObject(PyExc_BufferError, output);
+
+	Py_XDECREF(output);
+	output = NULL;
+done:
+	PyBuffer_Release(&view);
+	return output;
+}
+
+static PyObject *_encoded_size_call(struct wbin_options *opts, PyObject *args)
+{
+	struct serial_buffer buffer;
+	PyObject *input;
+	int size;
+
+	if (!PyArg_ParseTuple(args, "O", &input))
+		return NULL;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.opts = opts;
+
+	size = _encoded_size(input, &buffer);
+	if (0 > size)
+		return NULL;
+
+	return PyInt_FromLong(size);
+}
+
+static PyObject *_deserialize_call
+(
+	struct wbin_options *opts,
+	struct key_cache *keys,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"string", "callback", "args", "frequency",
+				 "select", "default", NULL};
+	struct serial_buffer buffer;
+	PyObject *output;
+	PyObject *input;
+	PyObject *yield = NULL;
+	PyObject *yargs = empty_tuple;
+	PyObject *select = NULL;
+	PyObject *fallback = Py_None;
+	int length = DEFAULT_MAX_RUN;
+	int result;
+
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "O!|OO!iOO", kwlist,
+					     &PyString_Type,
+					     (PyObject *)&input, &yield,
+					     &PyTuple_Type, &yargs,
+					     &length, &select, &fallback);
+	if (!result)
+		return NULL;
+
+	if (_check_callable(yield))
+		return NULL;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.len  = PyString_GET_SIZE(input);
+	buffer.buf  = PyString_AS_STRING(input);
+	buffer.owner = input;
+	buffer.func = yield;
+	buffer.size = length;
+	buffer.args = yargs;
+	buffer.opts = opts;
+	buffer.keys = keys;
+
+	if (select && select != Py_None)
+		output = _select_message(&buffer, select, fallback);
+	else
+		output = _deserialize_message(&buffer);
+	if (!output)
+		_deserialize_error(&buffer);
+
+	return output;
+}
+
+static PyObject *_deserialize_from_call
+(
+	struct wbin_options *opts,
+	struct key_cache *keys,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"buffer", "offset", NULL};
+	struct serial_buffer buffer;
+	Py_ssize_t offset = 0;
+	Py_buffer view;
+	PyObject *output = NULL;
+	PyObject *value;
+	PyObject *input;
+	int result;
+
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist,
+					     &input, &offset);
+	if (!result)
+		return NULL;
+
+	if (_get_buffer(input, &view, 0))
+		return NULL;
+
+	if (_check_offset(&view, offset))
+		goto done;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.buf  = (char *)view.buf + offset;
+	buffer.len  = view.len - offset;
+	buffer.opts = opts;
+	buffer.keys = keys;
+	buffer.owner = input;
+
+	value = _deserialize_message(&buffer);
+	if (!value) {
+		_deserialize_error(&buffer);
+		goto done;
+	}
+
+	output = Py_BuildValue("(Nn)", value, offset + buffer.off);
+done:
+	PyBuffer_Release(&view);
+	return output;
+}
+
+/*
+ * batch encode. every object is encoded as a message of its own, one
+ * after the other into the same buffer, with the offset at which each
+ * starts recorded.
+ */
+static PyObject *_serialize_many_call
+(
+	struct wbin_options *opts,
+	struct scratch_buffer *scratch,
+	PyObject *args
+)
+{
+	struct serial_buffer buffer;
+	PyObject *offsets;
+	PyObject *output = NULL;
+	PyObject *input;
+	PyObject *value;
+	PyObject *seq;
+	Py_ssize_t i;
+	int result = 0;
+	int pooled;
+	int start;
+
+	if (!PyArg_ParseTuple(args, "O", &input))
+		return NULL;
+
+	seq = PySequence_Fast(input, "objects must be a sequence");
+	if (!seq)
+		return NULL;
+
+	offsets = PyTuple_New(PySequence_Fast_GET_SIZE(seq));
+	if (!offsets)
+		goto done;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.opts = opts;
+
+	pooled = _scratch_acquire(scratch, &buffer);
+	if (0 > pooled)
+		goto done;
+
+	for (i = 0; i < PyTuple_GET_SIZE(offsets); i++) {
+		start = buffer.off;
+
+		value = PyInt_FromLong(start);
+		if (!value) {
+			result = -ENOMEM;
+			break;
+		}
+
+		PyTuple_SET_ITEM(offsets, i, value);
+
+		result = _serialize_message(PySequence_Fast_GET_ITEM(seq, i),
+					    &buffer);
+		if (!result)
+			result = _finish_message(&buffer, start);
+		if (result)
+			break;
+	}
+
+	if (!result)
+		output = Py_BuildValue("(s#O)", buffer.buf, buffer.off,
+				       offsets);
+
+	if (pooled)
+		_scratch_release(scratch, &buffer);
+	else
+		free(buffer.buf);
+done:
+	Py_XDECREF(offsets);
+	Py_DECREF(seq);
+	return output;
+}
+
+/*
+ * batch decode. w/o offsets the buffer is taken to hold consecutive
+ * messages up to its end.
+ */
+static PyObject *_deserialize_many_call
+(
+	struct wbin_options *opts,
+	struct key_cache *keys,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"buffer", "offsets", NULL};
+	struct serial_buffer buffer;
+	Py_ssize_t offset = 0;
+	Py_ssize_t count;
+	Py_ssize_t i;
+	Py_buffer view;
+	PyObject *offsets = NULL;
+	PyObject *output = NULL;
+	PyObject *input;
+	PyObject *value;
+	PyObject *seq = NULL;
+	int result;
+
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist,
+					     &input, &offsets);
+	if (!result)
+		return NULL;
+
+	if (_get_buffer(input, &view, 0))
+		return NULL;
+
+	if (offsets && Py_None != offsets) {
+		seq = PySequence_Fast(offsets, "offsets must be a sequence");
+		if (!seq)
+			goto done;
+
+		count = PySequence_Fast_GET_SIZE(seq);
+	} else
+		count = 0;
+
+	output = PyList_New(count);
+	if (!output)
+		goto done;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.opts = opts;
+	buffer.keys = keys;
+	buffer.owner = input;
+
+	for (i = 0; seq ? i < count : offset < view.len; i++) {
+		if (seq) {
+			value  = PySequence_Fast_GET_ITEM(seq, i);
+			offset = PyNumber_AsSsize_t(value, PyExc_ValueError);
+			if (offset == -1 && PyErr_Occurred())
+				goto error;
+		}
+
+		if (_check_offset(&view, offset))
+			goto error;
+
+		buffer.buf = (char *)view.buf + offset;
+		buffer.len = view.len - offset;
+		buffer.off = 0;
+
+		value = _deserialize_message(&buffer);
+		if (!value) {
+			_deserialize_error(&buffer);
+			goto error;
+		}
+
+		if (seq)
+			PyList_SET_ITEM(output, i, value);
+		else {
+			result = PyList_Append(output, value);
+			Py_DECREF(value);
+			if (result)
+				goto error;
+		}
+
+		offset += buffer.off;
+	}
+
+	goto done;
+error:
+	Py_CLEAR(output);
+done:
+	Py_XDECREF(seq);
+	PyBuffer_Release(&view);
+	return output;
+}
+
+static PyObject *py_serialize(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return _serialize_call(&default_options, NULL, args, kwds);
+}
+
+static PyObject *py_deserialize
+(
+	PyObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _deserialize_call(&default_options, &default_keys, args, kwds);
+}
+
+static PyObject *py_serialize_into
+(
+	PyObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _serialize_into_call(&default_options, args, kwds);
+}
+
+static PyObject *py_deserialize_from
+(
+	PyObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _deserialize_from_call(&default_options, &default_keys,
+				      args, kwds);
+}
+
+static PyObject *py_encoded_size(PyObject *self, PyObject *args)
+{
+	return _encoded_size_call(&default_options, args);
+}
+
+static PyObject *py_serialize_many(PyObject *self, PyObject *args)
+{
+	return _serialize_many_call(&default_options, NULL, args);
+}
+
+static PyObject *py_deserialize_many
+(
+	PyObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _deserialize_many_call(&default_options, &default_keys,
+				      args, kwds);
+}
+
+/*
+ * symbol tables, loaded into a Codec, Decoder or Encoder and freed with
+ * it. only exact str names are accepted, interned so that decoded keys
+ * are the very objects the table holds.
+ */
+static void _symbols_free(struct symbol_table *t)
+{
+	if (!t)
+		return;
+
+	Py_XDECREF(t->names);
+	Py_XDECREF(t->index);
+	free(t);
+}
+
+static PyObject *_symbols_load(struct wbin_options *opts, PyObject *args)
+{
+	struct symbol_table *t = NULL;
+	PyObject *names;
+	PyObject *name;
+	PyObject *seq;
+	PyObject *index;
+	Py_ssize_t version;
+	Py_ssize_t count;
+	Py_ssize_t i;
+	int result;
+
+	if (!PyArg_ParseTuple(args, "nO:load_symbols", &version, &names))
+		return NULL;
+
+	if (0 > version || version > UINT32_MAX) {
+		PyErr_Format(PyExc_ValueError,
+			     "symbol table version <%zd> out of range", version);
+		return NULL;
+	}
+
+	if (names == Py_None)
+		goto done;
+
+	seq = PySequence_Fast(names, "symbol names must be a sequence");
+	if (!seq)
+		return NULL;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	if (count > INT_MAX) {
+		PyErr_SetString(PyExc_ValueError, "too many symbols");
+		goto error;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		PyErr_NoMemory();
+		goto error;
+	}
+
+	t->version = version;
+	t->names   = PyTuple_New(count);
+	t->index   = PyDict_New();
+	if (!t->names || !t->index)
+		goto error;
+
+	for (i = 0; i < count; i++) {
+		name = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PyString_CheckExact(name)) {
+			PyErr_Format(PyExc_TypeError,
+				     "symbol <%zd> is not a str", i);
+			goto error;
+		}
+
+		Py_INCREF(name);
+		PyString_InternInPlace(&name);
+		PyTuple_SET_ITEM(t->names, i, name);
+
+		if (PyDict_GetItem(t->index, name)) {
+			PyErr_Format(PyExc_ValueError,
+				     "duplicate symbol <%s>",
+				     PyString_AS_STRING(name));
+			goto error;
+		}
+
+		index = PyInt_FromSsize_t(i);
+		if (!index)
+			goto error;
+
+		result = PyDict_SetItem(t->index, name, index);
+		Py_DECREF(index);
+		if (result)
+			goto error;
+	}
+
+	Py_DECREF(seq);
+done:
+	_symbols_free(opts->symbols);
+	opts->symbols = t;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+error:
+	_symbols_free(t);
+	Py_DECREF(seq);
+	return NULL;
+}
+
+static PyObject *_symbols_version(struct wbin_options *opts)
+{
+	if (!opts->symbols) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	return PyLong_FromUnsignedLong(opts->symbols->version);
+}
+
+/*
+ * Codec object. Carries a private set of options and a scratch encode
+ * buffer which is reused from one serialize call to the next.
+ */
+typedef struct {
+	PyObject_HEAD
+	struct wbin_options   opts;
+	struct scratch_buffer scratch;
+	struct key_cache      keys;
+} CodecObject;
+
+static int codec_init(CodecObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"buffer_size", NULL};
+	struct wbin_options opts = default_options;
+	int size = INIT_BUFFER_LEN;
+	PyObject *rest;
+	char *buf;
+	int result;
+
+	rest = _options_split(&opts, kwds);
+	if (!rest)
+		return -1;
+
+	result = PyArg_ParseTupleAndKeywords(args, rest, "|i", kwlist, &size);
+	Py_DECREF(rest);
+	if (!result)
+		return -1;
+
+	if (size < 64) {
+		PyErr_Format(PyExc_ValueError,
+			     "buffer size <%d> too small", size);
+		return -1;
+	}
+
+	if (self->scratch.busy) {
+		PyErr_SetString(PyExc_RuntimeError, "codec in use");
+		return -1;
+	}
+
+	buf = realloc(self->scratch.buf, size);
+	if (!buf) {
+		PyErr_Format(PyExc_MemoryError,
+			     "failed to allocate buffer <%d>", size);
+		return -1;
+	}
+
+	self->scratch.buf = buf;
+	self->scratch.len = size;
+	self->scratch.min = size;
+	self->scratch.avg = 0;
+
+	_key_cache_free(&self->keys);
+	if (_key_cache_init(&self->keys, opts.key_cache))
+		return -1;
+
+	opts.symbols = self->opts.symbols;
+	self->opts   = opts;
+	return 0;
+}
+
+static void codec_dealloc(CodecObject *self)
+{
+	_symbols_free(self->opts.symbols);
+	_key_cache_free(&self->keys);
+	free(self->scratch.buf);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyObject *codec_serialize
+(
+	CodecObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _serialize_call(&self->opts, &self->scratch, args, kwds);
+}
+
+static PyObject *codec_deserialize
+(
+	CodecObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _deserialize_call(&self->opts, &self->keys, args, kwds);
+}
+
+static PyObject *codec_serialize_into
+(
+	CodecObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _serialize_into_call(&self->opts, args, kwds);
+}
+
+static PyObject *codec_deserialize_from
+(
+	CodecObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _deserialize_from_call(&self->opts, &self->keys, args, kwds);
+}
+
+static PyObject *codec_encoded_size(CodecObject *self, PyObject *args)
+{
+	return _encoded_size_call(&self->opts, args);
+}
+
+static PyObject *codec_serialize_many(CodecObject *self, PyObject *args)
+{
+	return _serialize_many_call(&self->opts, &self->scratch, args);
+}
+
+static PyObject *codec_deserialize_many
+(
+	CodecObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	return _deserialize_many_call(&self->opts, &self->keys, args, kwds);
+}
+
+static PyObject *codec_load_symbols(CodecObject *self, PyObject *args)
+{
+	if (self->scratch.busy) {
+		PyErr_SetString(PyExc_RuntimeError, "codec in use");
+		return NULL;
+	}
+
+	return _symbols_load(&self->opts, args);
+}
+
+static PyObject *codec_symbols(CodecObject *self, void *closure)
+{
+	return _symbols_version(&self->opts);
+}
+
+static PyObject *codec_buffer_size(CodecObject *self, void *closure)
+{
+	return PyInt_FromLong(self->scratch.len);
+}
+
+static PyMethodDef codec_methods[] = {
+	{"serialize", (PyCFunction)codec_serialize,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("serialize(object[, callback[, args[, frequency[, exact]]]])"
+		   " -> string.\n\nSame as wbin.serialize() using this codec's "
+		   "options and scratch buffer.\n")},
+	{"deserialize", (PyCFunction)codec_deserialize,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("deserialize(string[, callback[, args[, frequency[, select"
+		   "[, default]]]]]) -> object.\n\nSame as wbin.deserialize() using this codec's "
+		   "options.\n")},
+	{"serialize_into", (PyCFunction)codec_serialize_into,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("serialize_into(object, buffer[, offset]) -> int\n\nSame "
+		   "as wbin.serialize_into() using this codec's options.\n")},
+	{"deserialize_from", (PyCFunction)codec_deserialize_from,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("deserialize_from(buffer[, offset]) -> (object, offset)"
+		   "\n\nSame as wbin.deserialize_from() using this codec's "
+		   "options.\n")},
+	{"encoded_size", (PyCFunction)codec_encoded_size, METH_VARARGS,
+	 PyDoc_STR("encoded_size(object) -> int\n\nSame as "
+		   "wbin.encoded_size() using this codec's options.\n")},
+	{"serialize_many", (PyCFunction)codec_serialize_many, METH_VARARGS,
+	 PyDoc_STR("serialize_many(objects) -> (string, offsets)\n\nSame "
+		   "as wbin.serialize_many() using this codec's options and"
+		   "\nscratch buffer.\n")},
+	{"deserialize_many", (PyCFunction)codec_deserialize_many,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("deserialize_many(buffer[, offsets]) -> list\n\nSame as "
+		   "wbin.deserialize_many() using this codec's options.\n")},
+	{"load_symbols", (PyCFunction)codec_load_symbols, METH_VARARGS,
+	 PyDoc_STR("load_symbols(version, names) -> None\n\nLoad a shared "
+		   "table of dict key names, replacing any loaded\nbefore. "
+		   "names is a sequence of str, None unloads the table.\n")},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef codec_members[] = {
+	{"utf8", T_INT, offsetof(CodecObject, opts.utf8), 0,
+	 PyDoc_STR("encode unicode as UTF8 (otherwise as plain strings)")},
+	{"whitelist", T_INT, offsetof(CodecObject, opts.wls), 0,
+	 PyDoc_STR("only pickle whitelisted object types")},
+	{"max_depth", T_INT, offsetof(CodecObject, opts.max_depth), 0,
+	 PyDoc_STR("maximum nesting depth of encoded and decoded objects")},
+	{NULL}
+};
+
+static PyGetSetDef codec_getset[] = {
+	{"buffer_size", (getter)codec_buffer_size, NULL,
+	 PyDoc_STR("current size of the scratch encode buffer"), NULL},
+	{"symbols", (getter)codec_symbols, NULL,
+	 PyDoc_STR("version of the loaded symbol table, or None"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(codec_documentation,
+	     "Codec([buffer_size][, **options])\n\n"
+	     "Encoder/decoder with its own option set, independent of the "
+	     "module\nlevel settings, and a scratch encode buffer which is "
+	     "kept between\ncalls. The buffer starts at buffer_size bytes, "
+	     "grows as needed and\nshrinks back when recent messages are "
+	     "much smaller than it.\n\nOptions (keywords): utf8, whitelist, "
+	     "max_depth, indexed, key_cache,\ncache_values, version, "
+	     "little_endian, packed, ndarray, extended, refs,\nschemas, "
+	     "compress, checksum. Defaults are taken from the module "
+	     "level\nsettings at creation time.\n\n"
+	     "version=2 selects the compact encoding: one byte type tags "
+	     "carrying\nsmall ints and short lengths, varint lengths and "
+	     "zigzag varint ints,\nand float32 for floats which round trip "
+	     "exactly. Payloads of either\nversion are always decoded.\n\n"
+	     "little_endian writes fixed width fields in little endian "
+	     "order, which\nlittle endian hosts encode and decode w/o byte "
+	     "swapping. The order is\nrecorded in the message header.\n\n"
+	     "packed writes lists and tuples of at least 4 plain ints, or "
+	     "of floats,\nas a single block of int32, int64 or float64 "
+	     "values.\n\n"
+	     "ndarray encodes numpy arrays of plain dtypes natively, as "
+	     "dtype, shape,\nstrides and raw data. They decode to read only "
+	     "arrays referring into\na str input rather than copies.\n\n"
+	     "extended encodes bool, set, frozenset, naive datetime and "
+	     "Decimal\nnatively, rather than as ints or pickles. They are "
+	     "always decoded.\n\n"
+	     "refs writes repeated strings (of at least 4 bytes) and "
+	     "containers\nwhich occur more than once as back references to "
+	     "their first\noccurrence. They decode as the same object, "
+	     "shared and cyclic\nstructures included. select and views "
+	     "decode such messages whole.\n\n"
+	     "schemas writes dicts matching a schema registered with\n"
+	     "register_schema() as records: the schema id and the values in "
+	     "field\norder, w/o any keys. Records are always decoded, but "
+	     "only with the\nsame fields registered under their id.\n\n"
+	     "compress=N compresses (LZ4 block format) the serialize() and\n"
+	     "serialize_into() output of messages of at least N bytes, "
+	     "when that\nmakes them smaller. Compression and "
+	     "decompression run w/o the GIL.\nencoded_size() reports the "
+	     "uncompressed size, Encoder streams are\nnot compressed. "
+	     "Compressed messages are always decoded.\n\n"
+	     "checksum frames the serialize() and serialize_into() output "
+	     "with its\nlength and a CRC32C (SSE4.2 when available), which "
+	     "is verified\nbefore anything is decoded, unframed messages are "
+	     "then rejected.\nEncoder streams are not checksummed.\n\n"
+	     "load_symbols(version, names) loads a table of dict key names "
+	     "shared\nwith the peer. Keys found in it are written as their "
+	     "index and\ndecoded to the table's interned str, others are "
+	     "written inline.\nMessages carry the table version and are "
+	     "only decoded with the\nsame version loaded. Views cannot "
+	     "decode them.\n\n"
+	     "Decoded dict keys of up to 64 bytes are looked up by their raw "
+	     "bytes\nin a cache of key_cache entries (default 1024, 0 "
+	     "disables) before\nany allocation. With cache_values short "
+	     "string values are cached\nas well.\n");
+
+static PyTypeObject CodecType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.Codec",				/* tp_name */
+	sizeof(CodecObject),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)codec_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	codec_documentation,			/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	codec_methods,				/* tp_methods */
+	codec_members,				/* tp_members */
+	codec_getset,				/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)codec_init,			/* tp_init */
+	0,					/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+};
+
+/*
+ * Decoder object. Incremental decoder for a stream of back to back
+ * encoded objects arriving in arbitrary chunks. Received data is
+ * scanned once, as it arrives, and each object is decoded as soon as
+ * its last byte is in.
+ */
+typedef struct {
+	PyObject_HEAD
+	struct wbin_options opts;
+	struct scan_state   scan;
+	struct key_cache    keys;
+	char *buf;
+	int   len;	/* bytes held */
+	int   room;	/* buffer capacity */
+	int   start;	/* offset of the message being scanned */
+	int   busy;
+} DecoderObject;
+
+static int decoder_init(DecoderObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {NULL};
+	struct wbin_options opts = default_options;
+	PyObject *rest;
+	int result;
+
+	rest = _options_split(&opts, kwds);
+	if (!rest)
+		return -1;
+
+	result = PyArg_ParseTupleAndKeywords(args, rest, "", kwlist);
+	Py_DECREF(rest);
+	if (!result)
+		return -1;
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder in use");
+		return -1;
+	}
+
+	_scan_free(&self->scan);
+	self->len   = 0;
+	self->start = 0;
+
+	_key_cache_free(&self->keys);
+	if (_key_cache_init(&self->keys, opts.key_cache))
+		return -1;
+
+	opts.symbols = self->opts.symbols;
+	self->opts   = opts;
+	return 0;
+}
+
+static void decoder_dealloc(DecoderObject *self)
+{
+	_symbols_free(self->opts.symbols);
+	_key_cache_free(&self->keys);
+	_scan_free(&self->scan);
+	free(self->buf);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static int _decoder_append(DecoderObject *self, const char *data, int size)
+{
+	char *new;
+	int room;
+
+	if (!size)
+		return 0;
+
+	if (size > (INT_MAX - self->len)) {
+		PyErr_SetString(PyExc_MemoryError, "decoder buffer overflow");
+		return -ENOMEM;
+	}
+
+	if ((self->room - self->len) < size) {
+		for (room = MAX(self->room, INIT_BUFFER_LEN);
+		     (room - self->len) < size && room < (INT_MAX / 2);
+		     room *= 2);
+
+		room = MAX(room, self->len + size);
+
+		new = realloc(self->buf, room);
+		if (!new) {
+			PyErr_Format(PyExc_MemoryError,
+				     "failed to reallocate buffer to <%d>",
+				     room);
+			return -ENOMEM;
+		}
+
+		self->buf  = new;
+		self->room = room;
+	}
+
+	memcpy(self->buf + self->len, data, size);
+	self->len += size;
+	return 0;
+}
+
+static PyObject *_decoder_next(DecoderObject *self)
+{
+	struct serial_buffer buffer;
+	PyObject *output;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.buf  = self->buf + self->start;
+	buffer.len  = self->scan.pos - self->start;
+	buffer.opts = &self->opts;
+	buffer.keys = &self->keys;
+
+	output = _deserialize_message(&buffer);
+	if (!output) {
+		_deserialize_error(&buffer);
+		return NULL;
+	}
+
+	self->start = self->scan.pos;
+	return output;
+}
+
+/*
+ * attach the objects decoded ahead of a failure to the pending
+ * exception, as its decoded attribute.
+ */
+static void _decoder_error(PyObject *decoded)
+{
+	PyObject *type;
+	PyObject *value;
+	PyObject *trace;
+
+	PyErr_Fetch(&type, &value, &trace);
+	PyErr_NormalizeException(&type, &value, &trace);
+
+	if (value && PyObject_SetAttrString(value, "decoded", decoded))
+		PyErr_Clear();
+
+	PyErr_Restore(type, value, trace);
+}
+
+static PyObject *decoder_feed(DecoderObject *self, PyObject *args)
+{
+	Py_buffer view;
+	PyObject *output;
+	PyObject *value;
+	PyObject *input;
+	int result;
+
+	if (!PyArg_ParseTuple(args, "O", &input))
+		return NULL;
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder in use");
+		return NULL;
+	}
+
+	if (_get_buffer(input, &view, 0))
+		return NULL;
+
+	result = _decoder_append(self, view.buf, view.len);
+	PyBuffer_Release(&view);
+	if (result)
+		return NULL;
+
+	output = PyList_New(0);
+	if (!output)
+		return NULL;
+
+	self->busy = 1;
+
+	for (;;) {
+		result = _scan(&self->scan, self->buf, self->len,
+			       self->opts.max_depth);
+		if (result <= 0)
+			break;
+
+		value = _decoder_next(self);
+		if (!value) {
+			result = -EINVAL;
+			break;
+		}
+
+		self->scan.body = 0;
+
+		result = PyList_Append(output, value);
+		Py_DECREF(value);
+		if (result)
+			break;
+	}
+
+	self->busy = 0;
+	/*
+	 * on error the stream can not be resynchronized, drop whatever
+	 * has been buffered. the objects completed before the bad message
+	 * are handed over on the exception.
+	 */
+	if (result < 0) {
+		_scan_free(&self->scan);
+		self->len   = 0;
+		self->start = 0;
+		_decoder_error(output);
+		Py_DECREF(output);
+		return NULL;
+	}
+	/*
+	 * move the partial message to the front of the buffer. this only
+	 * happens after a message has completed, so each byte is moved at
+	 * most once.
+	 */
+	if (self->start) {
+		memmove(self->buf, self->buf + self->start,
+			self->len - self->start);
+		self->len      -= self->start;
+		self->scan.pos -= self->start;
+		self->start     = 0;
+	}
+
+	return output;
+}
+
+static PyObject *decoder_reset(DecoderObject *self, PyObject *noargs)
+{
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder in use");
+		return NULL;
+	}
+
+	_scan_free(&self->scan);
+	self->len   = 0;
+	self->start = 0;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *decoder_load_symbols(DecoderObject *self, PyObject *args)
+{
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder in use");
+		return NULL;
+	}
+
+	return _symbols_load(&self->opts, args);
+}
+
+static PyObject *decoder_symbols(DecoderObject *self, void *closure)
+{
+	return _symbols_version(&self->opts);
+}
+
+static PyObject *decoder_pending(DecoderObject *self, void *closure)
+{
+	return PyInt_FromLong(self->len - self->start);
+}
+
+static PyMethodDef decoder_methods[] = {
+	{"feed", (PyCFunction)decoder_feed, METH_VARARGS,
+	 PyDoc_STR("feed(data) -> list\n\nAppend data (any readable buffer) "
+		   "to the stream and return the list of\nobjects completed "
+		   "by it, possibly empty. A malformed message resets\nthe "
+		   "stream; the objects completed ahead of it are attached "
+		   "to the\nexception raised as its decoded attribute.\n")},
+	{"reset", (PyCFunction)decoder_reset, METH_NOARGS,
+	 PyDoc_STR("reset() -> None\n\nDiscard any partially received "
+		   "data.\n")},
+	{"load_symbols", (PyCFunction)decoder_load_symbols, METH_VARARGS,
+	 PyDoc_STR("load_symbols(version, names) -> None\n\nLoad a shared "
+		   "table of dict key names, replacing any loaded\nbefore. "
+		   "names is a sequence of str, None unloads the table.\n")},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef decoder_members[] = {
+	{"max_depth", T_INT, offsetof(DecoderObject, opts.max_depth), 0,
+	 PyDoc_STR("maximum nesting depth of decoded objects")},
+	{NULL}
+};
+
+static PyGetSetDef decoder_getset[] = {
+	{"pending", (getter)decoder_pending, NULL,
+	 PyDoc_STR("number of received bytes not yet decoded"), NULL},
+	{"symbols", (getter)decoder_symbols, NULL,
+	 PyDoc_STR("version of the loaded symbol table, or None"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(decoder_documentation,
+	     "Decoder([**options])\n\n"
+	     "Incremental decoder for a stream of serialized objects. Data "
+	     "is passed\nto feed() in chunks of any size as it is received; "
+	     "partial messages\nare kept along with their parse progress, "
+	     "so no data is parsed twice.\n");
+
+static PyTypeObject DecoderType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.Decoder",				/* tp_name */
+	sizeof(DecoderObject),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)decoder_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	decoder_documentation,			/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	decoder_methods,			/* tp_methods */
+	decoder_members,			/* tp_members */
+	decoder_getset,				/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)decoder_init,			/* tp_init */
+	0,					/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+};
+
+/*
+ * Encoder object. Streams encoded objects to a file descriptor or file
+ * like object, flushing whenever the internal buffer reaches its high
+ * water mark, so memory use is bounded regardless of payload size.
+ */
+typedef struct {
+	PyObject_HEAD
+	struct wbin_options opts;
+	struct stream_sink  sink;
+	char *buf;
+	int   len;	/* buffer capacity */
+	int   off;	/* bytes buffered */
+	int   mark;	/* high water mark */
+	int   busy;
+} EncoderObject;
+
+static int encoder_init(EncoderObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"file", "high_water", NULL};
+	struct wbin_options opts = default_options;
+	int mark = DEFAULT_HIGH_WATER;
+	PyObject *write = NULL;
+	PyObject *file;
+	PyObject *rest;
+	char *buf;
+	int result;
+	int fd = -1;
+
+	rest = _options_split(&opts, kwds);
+	if (!rest)
+		return -1;
+
+	result = PyArg_ParseTupleAndKeywords(args, rest, "O|i", kwlist,
+					     &file, &mark);
+	Py_DECREF(rest);
+	if (!result)
+		return -1;
+
+	if (mark < 64) {
+		PyErr_Format(PyExc_ValueError,
+			     "high water mark <%d> too small", mark);
+		return -1;
+	}
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder in use");
+		return -1;
+	}
+
+	if (PyInt_Check(file) || PyLong_Check(file)) {
+		fd = PyObject_AsFileDescriptor(file);
+		if (0 > fd)
+			return -1;
+	} else {
+		write = PyObject_GetAttrString(file, "write");
+		if (!write)
+			return -1;
+	}
+
+	buf = realloc(self->buf, mark);
+	if (!buf) {
+		Py_XDECREF(write);
+		PyErr_Format(PyExc_MemoryError,
+			     "failed to allocate buffer <%d>", mark);
+		return -1;
+	}
+
+	Py_XDECREF(self->sink.write);
+	self->sink.write = write;
+	self->sink.fd    = fd;
+	self->sink.total = 0;
+
+	self->buf  = buf;
+	self->len  = mark;
+	self->off  = 0;
+	self->mark = mark;
+
+	opts.symbols = self->opts.symbols;
+	self->opts   = opts;
+	return 0;
+}
+
+static void encoder_dealloc(EncoderObject *self)
+{
+	_symbols_free(self->opts.symbols);
+	Py_XDECREF(self->sink.write);
+	free(self->buf);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static int _encoder_begin(EncoderObject *self, struct serial_buffer *b)
+{
+	if (!self->buf) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder not initialized");
+		return -EINVAL;
+	}
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder in use");
+		return -EBUSY;
+	}
+
+	memset(b, 0, sizeof(*b));
+	b->buf  = self->buf;
+	b->len  = self->len;
+	b->off  = self->off;
+	b->sink = &self->sink;
+	b->opts = &self->opts;
+
+	self->busy = 1;
+	return 0;
+}
+
+static void _encoder_end(EncoderObject *self, struct serial_buffer *b)
+{
+	char *new;
+
+	self->buf  = b->buf;
+	self->len  = b->len;
+	self->off  = b->off;
+	self->busy = 0;
+	/*
+	 * an element too large to be flushed in pieces may have grown the
+	 * buffer, return it to the high water mark.
+	 */
+	if (self->len <= self->mark || self->off > self->mark)
+		return;
+
+	new = realloc(self->buf, self->mark);
+	if (!new)
+		return;
+
+	self->buf = new;
+	self->len = self->mark;
+}
+
+static PyObject *encoder_write
+(
+	EncoderObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"object", "flush", NULL};
+	struct serial_buffer buffer;
+	PY_LONG_LONG total;
+	PyObject *input;
+	int flush = 1;
+	int start;
+	int result;
+
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist,
+					     &input, &flush);
+	if (!result)
+		return NULL;
+
+	if (self->opts.indexed) {
+		PyErr_SetString(PyExc_ValueError,
+				"indexed payloads can not be streamed");
+		return NULL;
+	}
+
+	if (_encoder_begin(self, &buffer))
+		return NULL;
+
+	total = self->sink.total;
+	start = buffer.off;
+
+	result = _serialize_message(input, &buffer);
+	if (!result && flush)
+		result = _flush(&buffer);
+	/*
+	 * drop the partially encoded object, if nothing of it has been
+	 * flushed yet the stream is left as it was.
+	 */
+	if (result)
+		buffer.off = (total == self->sink.total) ? start : 0;
+
+	_encoder_end(self, &buffer);
+	if (result)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *encoder_flush(EncoderObject *self, PyObject *noargs)
+{
+	struct serial_buffer buffer;
+	int result;
+
+	if (_encoder_begin(self, &buffer))
+		return NULL;
+
+	result = _flush(&buffer);
+
+	_encoder_end(self, &buffer);
+	if (result)
+		return NULL;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *encoder_load_symbols(EncoderObject *self, PyObject *args)
+{
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder in use");
+		return NULL;
+	}
+
+	return _symbols_load(&self->opts, args);
+}
+
+static PyObject *encoder_symbols(EncoderObject *self, void *closure)
+{
+	return _symbols_version(&self->opts);
+}
+
+static PyObject *encoder_written(EncoderObject *self, void *closure)
+{
+	return PyLong_FromLongLong(self->sink.total);
+}
+
+static PyObject *encoder_pending(EncoderObject *self, void *closure)
+{
+	return PyInt_FromLong(self->off);
+}
+
+static PyMethodDef encoder_methods[] = {
+	{"write", (PyCFunction)encoder_write, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("write(object[, flush]) -> None\n\nEncode object to the "
+		   "stream. Unless flush is false any data still\nbuffered "
+		   "is written out before returning.\n")},
+	{"flush", (PyCFunction)encoder_flush, METH_NOARGS,
+	 PyDoc_STR("flush() -> None\n\nWrite out any buffered data.\n")},
+	{"load_symbols", (PyCFunction)encoder_load_symbols, METH_VARARGS,
+	 PyDoc_STR("load_symbols(version, names) -> None\n\nLoad a shared "
+		   "table of dict key names, replacing any loaded\nbefore. "
+		   "names is a sequence of str, None unloads the table.\n")},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef encoder_members[] = {
+	{"utf8", T_INT, offsetof(EncoderObject, opts.utf8), 0,
+	 PyDoc_STR("encode unicode as UTF8 (otherwise as plain strings)")},
+	{"whitelist", T_INT, offsetof(EncoderObject, opts.wls), 0,
+	 PyDoc_STR("only pickle whitelisted object types")},
+	{"max_depth", T_INT, offsetof(EncoderObject, opts.max_depth), 0,
+	 PyDoc_STR("maximum nesting depth of encoded objects")},
+	{"high_water", T_INT, offsetof(EncoderObject, mark), READONLY,
+	 PyDoc_STR("buffered bytes at which data is flushed")},
+	{NULL}
+};
+
+static PyGetSetDef encoder_getset[] = {
+	{"written", (getter)encoder_written, NULL,
+	 PyDoc_STR("total bytes written to the stream"), NULL},
+	{"pending", (getter)encoder_pending, NULL,
+	 PyDoc_STR("bytes buffered and not yet written"), NULL},
+	{"symbols", (getter)encoder_symbols, NULL,
+	 PyDoc_STR("version of the loaded symbol table, or None"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(encoder_documentation,
+	     "Encoder(file[, high_water][, **options])\n\n"
+	     "Streaming encoder. file is either a file descriptor or an "
+	     "object with\na write() method. Output is buffered and "
+	     "written out each time\nhigh_water bytes (default 64K) have "
+	     "accumulated, large strings are\nwritten through directly. "
+	     "The wire format is the same as serialize().\nBuffered data "
+	     "is not written out implicitly when the encoder is\n"
+	     "destroyed.\n");
+
+static PyTypeObject EncoderType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.Encoder",				/* tp_name */
+	sizeof(EncoderObject),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)encoder_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	encoder_documentation,			/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	encoder_methods,			/* tp_methods */
+	encoder_members,			/* tp_members */
+	encoder_getset,				/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)encoder_init,			/* tp_init */
+	0,					/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+};
+
+/*
+ * Stepped objects. Encode or decode a single message a slice at a
+ * time: each step() runs the engine until a byte and/or time budget is
+ * spent and returns, the containers still open stay on the engine's
+ * stack so the next step picks up where the last one stopped.
+ */
+#define STEP_START  0
+#define STEP_BODY   1
+#define STEP_DONE   2
+#define STEP_FAILED 3
+
+static int _step_check(int state, int busy, const char *name)
+{
+	if (busy) {
+		PyErr_Format(PyExc_RuntimeError, "%s in use", name);
+		return -EBUSY;
+	}
+
+	if (state == STEP_FAILED) {
+		PyErr_Format(PyExc_RuntimeError, "%s failed", name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int _step_args
+(
+	PyObject *args,
+	PyObject *kwds,
+	int *budget,
+	double *seconds
+)
+{
+	static char *kwlist[] = {"budget", "seconds", NULL};
+
+	*budget  = DEFAULT_STEP_BUDGET;
+	*seconds = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|id:step", kwlist,
+					 budget, seconds))
+		return -EINVAL;
+
+	return 0;
+}
+
+static PyObject *_step_result(PyObject *output, int state)
+{
+	if (state != STEP_DONE) {
+		PyErr_SetString(PyExc_RuntimeError, "not done");
+		return NULL;
+	}
+
+	Py_INCREF(output);
+	return output;
+}
+
+typedef struct {
+	PyObject_HEAD
+	struct wbin_options  opts;
+	struct key_cache     keys;
+	struct serial_buffer buffer;
+	struct decode_stack  stack;
+	struct ref_table     refs;
+	PyObject *input;	/* string being decoded */
+	PyObject *raw;		/* decompressed body, if any */
+	PyObject *output;	/* decoded object, once done */
+	int state;
+	int busy;
+} StepDecoderObject;
+
+static void _step_decoder_release(StepDecoderObject *self)
+{
+	_decode_free(&self->stack);
+	_decode_init(&self->stack, NULL, 0);
+	_ref_free(&self->refs);
+	Py_CLEAR(self->raw);
+	Py_CLEAR(self->input);
+}
+
+static int step_decoder_init
+(
+	StepDecoderObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"string", NULL};
+	struct wbin_options opts = default_options;
+	PyObject *input;
+	PyObject *rest;
+	int result;
+
+	rest = _options_split(&opts, kwds);
+	if (!rest)
+		return -1;
+
+	result = PyArg_ParseTupleAndKeywords(args, rest, "O!", kwlist,
+					     &PyString_Type, &input);
+	Py_DECREF(rest);
+	if (!result)
+		return -1;
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder in use");
+		return -1;
+	}
+
+	_step_decoder_release(self);
+	Py_CLEAR(self->output);
+
+	_key_cache_free(&self->keys);
+	if (_key_cache_init(&self->keys, opts.key_cache))
+		return -1;
+
+	opts.symbols = self->opts.symbols;
+	self->opts   = opts;
+
+	Py_INCREF(input);
+	self->input = input;
+	self->state = STEP_START;
+
+	memset(&self->buffer, 0, sizeof(self->buffer));
+	self->buffer.buf   = PyString_AS_STRING(input);
+	self->buffer.len   = PyString_GET_SIZE(input);
+	self->buffer.owner = input;
+	self->buffer.opts  = &self->opts;
+	self->buffer.keys  = &self->keys;
+	return 0;
+}
+
+static void step_decoder_dealloc(StepDecoderObject *self)
+{
+	_step_decoder_release(self);
+	Py_XDECREF(self->output);
+	_symbols_free(self->opts.symbols);
+	_key_cache_free(&self->keys);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+/*
+ * read the format header, checksum and decompress as needed; the body
+ * is then decoded in steps.
+ */
+static int _step_decoder_start(StepDecoderObject *self)
+{
+	struct serial_buffer *b = &self->buffer;
+	struct serial_buffer inner;
+	int size;
+
+	size = _get_header(b->buf, b->len, &b->format);
+	if (size == -EAGAIN)
+		_check_space(b, FORMAT_HEADER_MAX);
+	if (0 > size)
+		return -EINVAL;
+
+	if (_check_frame(b->buf, b->len, &b->format, b->opts->checksum))
+		return -EINVAL;
+
+	if (_check_symbols(b->opts->symbols, b->buf, b->format))
+		return -EINVAL;
+
+	b->off = size;
+	if (b->format & FORMAT_LZ) {
+		self->raw = _inflate(b, &inner);
+		if (!self->raw)
+			return -EINVAL;
+
+		*b = inner;
 	}
 
-	result = _check_space(b, sizeof(uint16_t));
-	if (result)
+	if (b->format & FORMAT_REFS) {
+		_ref_init(&self->refs, 0);
+		b->refs = &self->refs;
+	}
+
+	self->state = STEP_BODY;
+	return 0;
+}
+
+static PyObject *step_decoder_step
+(
+	StepDecoderObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	struct serial_buffer *b = &self->buffer;
+	double seconds;
+	int budget;
+	int result;
+
+	if (_step_args(args, kwds, &budget, &seconds))
 		return NULL;
 
-	type = ntohs(*(uint16_t *)(b->buf + b->off));
-	b->off += sizeof(uint16_t);
+	if (_step_check(self->state, self->busy, "decoder"))
+		return NULL;
 
-	switch (type) {
-	case TYPE_INT:
-		result = _check_space(b, sizeof(uint32_t));
-		if (result)
-			break;
-		output = PyInt_FromLong((int32_t)ntohl(*(uint32_t *)(b->buf + b->off)));
-		b->off += sizeof(uint32_t);
-		break;
-	case TYPE_LONG:
-		result = _check_space(b, sizeof(uint64_t));
-		if (result)
-			break;
-#if !defined(__APPLE__)
-		output = PyInt_FromLong(ntohll(*(uint64_t *)(b->buf + b->off)));
-#else
-		output = PyLong_FromLongLong(ntohll(*(uint64_t *)(b->buf + b->off)));
-#endif
-		b->off += sizeof(uint64_t);
-		break;
-	case TYPE_LONGER:
-		size = _get_size(b);
-		if (0 > size)
-			break;
-		result = _check_space(b, size);
-		if (result)
-			break;
+	if (self->state == STEP_DONE)
+		return PyBool_FromLong(1);
 
-		output = _PyLong_FromByteArray(
-			(unsigned char *)(b->buf + b->off), size, 0, 1);
-		b->off += size;
-		break;
-	case TYPE_DOUBLE:
-		result = _check_space(b, sizeof(double));
+	if (!self->input) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder not initialized");
+		return NULL;
+	}
+
+	self->busy = 1;
+
+	result = 0;
+	if (self->state == STEP_START)
+		result = _step_decoder_start(self);
+	if (!result) {
+		_step_begin(b, budget, seconds);
+		result = _decode_run(b, &self->stack, 0, &self->output);
+	}
+
+	self->busy = 0;
+
+	if (result == -EAGAIN)
+		return PyBool_FromLong(0);
+
+	if (!result && self->raw && b->off != b->len) {
+		PyErr_Format(PyExc_SystemError,
+			     "compressed length mismatch <%d> at <%d>",
+			     b->len, b->off);
+		Py_CLEAR(self->output);
+		result = -EINVAL;
+	}
+
+	_step_decoder_release(self);
+
+	if (result) {
+		_deserialize_error(b);
+		self->state = STEP_FAILED;
+		return NULL;
+	}
+
+	self->state = STEP_DONE;
+	return PyBool_FromLong(1);
+}
+
+static PyObject *step_decoder_load_symbols
+(
+	StepDecoderObject *self,
+	PyObject *args
+)
+{
+	if (self->busy || self->state != STEP_START) {
+		PyErr_SetString(PyExc_RuntimeError, "decoder already started");
+		return NULL;
+	}
+
+	return _symbols_load(&self->opts, args);
+}
+
+static PyObject *step_decoder_symbols(StepDecoderObject *self, void *closure)
+{
+	return _symbols_version(&self->opts);
+}
+
+static PyObject *step_decoder_done(StepDecoderObject *self, void *closure)
+{
+	return PyBool_FromLong(self->state == STEP_DONE);
+}
+
+static PyObject *step_decoder_offset(StepDecoderObject *self, void *closure)
+{
+	return PyInt_FromLong(self->buffer.off);
+}
+
+static PyObject *step_decoder_result(StepDecoderObject *self, void *closure)
+{
+	return _step_result(self->output, self->state);
+}
+
+static PyMethodDef step_decoder_methods[] = {
+	{"step", (PyCFunction)step_decoder_step, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("step([budget][, seconds]) -> bool\n\nDecode until about "
+		   "budget bytes (default 64K, 0 for no limit) have\nbeen "
+		   "consumed or seconds (default none) have passed, whichever "
+		   "is\nfirst. Returns True once the object is complete.\n")},
+	{"load_symbols", (PyCFunction)step_decoder_load_symbols, METH_VARARGS,
+	 PyDoc_STR("load_symbols(version, names) -> None\n\nLoad a shared "
+		   "table of dict key names, before the first step.\n")},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef step_decoder_getset[] = {
+	{"done", (getter)step_decoder_done, NULL,
+	 PyDoc_STR("whether the object has been decoded"), NULL},
+	{"offset", (getter)step_decoder_offset, NULL,
+	 PyDoc_STR("bytes of the message body decoded so far"), NULL},
+	{"result", (getter)step_decoder_result, NULL,
+	 PyDoc_STR("the decoded object, once done"), NULL},
+	{"symbols", (getter)step_decoder_symbols, NULL,
+	 PyDoc_STR("version of the loaded symbol table, or None"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(step_decoder_documentation,
+	     "StepDecoder(string[, **options])\n\n"
+	     "Decoder for one serialized object which works in steps, for "
+	     "use from\nan event loop. Each step() decodes a slice of the "
+	     "message and returns,\nkeeping its progress. A compressed "
+	     "message is checked and decompressed\nin the first step. "
+	     "string must not be modified until done.\n");
+
+static PyTypeObject StepDecoderType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.StepDecoder",			/* tp_name */
+	sizeof(StepDecoderObject),		/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)step_decoder_dealloc,	/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	step_decoder_documentation,		/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	step_decoder_methods,			/* tp_methods */
+	0,					/* tp_members */
+	step_decoder_getset,			/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)step_decoder_init,		/* tp_init */
+	0,					/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct wbin_options  opts;
+	struct serial_buffer buffer;
+	struct encode_stack  stack;
+	struct ref_table     refs;
+	PyObject *input;	/* object being encoded */
+	PyObject *output;	/* encoded string, once done */
+	int state;
+	int busy;
+} StepEncoderObject;
+
+static void _step_encoder_release(StepEncoderObject *self)
+{
+	_encode_free(&self->stack);
+	_encode_init(&self->stack, NULL, 0);
+	_ref_free(&self->refs);
+	Py_CLEAR(self->input);
+
+	free(self->buffer.buf);
+	self->buffer.buf = NULL;
+}
+
+static int step_encoder_init
+(
+	StepEncoderObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	static char *kwlist[] = {"object", NULL};
+	struct wbin_options opts = default_options;
+	PyObject *input;
+	PyObject *rest;
+	int result;
+
+	rest = _options_split(&opts, kwds);
+	if (!rest)
+		return -1;
+
+	result = PyArg_ParseTupleAndKeywords(args, rest, "O", kwlist, &input);
+	Py_DECREF(rest);
+	if (!result)
+		return -1;
+
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder in use");
+		return -1;
+	}
+
+	_step_encoder_release(self);
+	Py_CLEAR(self->output);
+
+	opts.symbols = self->opts.symbols;
+	self->opts   = opts;
+
+	Py_INCREF(input);
+	self->input = input;
+	self->state = STEP_START;
+
+	memset(&self->buffer, 0, sizeof(self->buffer));
+	self->buffer.opts = &self->opts;
+	return 0;
+}
+
+static void step_encoder_dealloc(StepEncoderObject *self)
+{
+	_step_encoder_release(self);
+	Py_XDECREF(self->output);
+	_symbols_free(self->opts.symbols);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+/*
+ * write the format header and open the top level value.
+ */
+static int _step_encoder_start(StepEncoderObject *self)
+{
+	struct serial_buffer *b = &self->buffer;
+	int result;
+
+	b->len = INIT_BUFFER_LEN;
+	b->buf = malloc(b->len);
+	if (!b->buf) {
+		PyErr_Format(PyExc_MemoryError,
+			     "failed to allocate buffer <%d>", b->len);
+		return -ENOMEM;
+	}
+
+	result = _serialize_header(b);
+	if (result)
+		return result;
+
+	if (b->format & FORMAT_REFS) {
+		result = _ref_init(&self->refs, 1);
 		if (result)
+			return result;
+
+		b->refs = &self->refs;
+	}
+
+	self->state = STEP_BODY;
+	return _serialize_value(self->input, b, &self->stack);
+}
+
+/*
+ * containers left open by the last step must not have changed size
+ * since, their element counts are already written.
+ */
+static int _step_encoder_verify(StepEncoderObject *self)
+{
+	struct encode_frame *f;
+	Py_ssize_t size;
+	int i;
+
+	for (i = 0; i < self->stack.depth; i++) {
+		f = &self->stack.frames[i];
+
+		switch (f->type) {
+		case TYPE_LIST:
+			size = PyList_GET_SIZE(f->input);
 			break;
-		output = PyFloat_FromDouble(*(double *)(b->buf + b->off));
-		b->off += sizeof(double);
-		break;
-	case TYPE_STRING:
-		size = _get_size(b);
-		if (0 > size)
+		case TYPE_DICT:
+			size = PyDict_Size(f->input);
 			break;
-		result = _check_space(b, size);
-		if (result)
+		case TYPE_SET:
+			size = PySet_GET_SIZE(f->input);
 			break;
+		default:
+			continue;
+		}
 
-		output = PyString_FromStringAndSize((b->buf + b->off), size);
-		if (intern)
-			PyString_InternInPlace(&output);
+		if (size != f->size) {
+			PyErr_Format(PyExc_RuntimeError,
+				     "%s changed size during encode",
+				     f->input->ob_type->tp_name);
+			return -EINVAL;
+		}
+	}
 
-		b->off += size;
-		break;
-	case TYPE_UTF8:
-		size = _get_size(b);
-		if (0 > size)
-			break;
-		result = _check_space(b, size);
-		if (result)
-			break;
+	return 0;
+}
 
-		output = PyUnicode_DecodeUTF8((b->buf + b->off), size, "strict");
-		b->off += size;
-		break;
-	case TYPE_LIST:
-		size = _get_size(b);
-		if (0 > size)
-			break;
+static PyObject *step_encoder_step
+(
+	StepEncoderObject *self,
+	PyObject *args,
+	PyObject *kwds
+)
+{
+	struct serial_buffer *b = &self->buffer;
+	double seconds;
+	int budget;
+	int result;
 
-		output = PyList_New(size);
-		if (!output)
-			break;
+	if (_step_args(args, kwds, &budget, &seconds))
+		return NULL;
 
-		for (i = 0; i < size; i++) {
-			value = _deserialize(b, 0);
-			if (!value)
-				break;
+	if (_step_check(self->state, self->busy, "encoder"))
+		return NULL;
 
-			result = PyList_SetItem(output, i, value);
-			if (result)
-				/*
-				 * SetItem decrements value refcnt on error
-				 * and does not increase it on success.
-				 */
-				break;
-		}
+	if (self->state == STEP_DONE)
+		return PyBool_FromLong(1);
 
-		if (size > i) {
-			Py_DECREF(output);
-			output = NULL;
-		}
-		break;
-	case TYPE_DICT:
-		size = _get_size(b);
-		if (0 > size)
-			break;
+	if (!self->input) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder not initialized");
+		return NULL;
+	}
 
-		output = PyDict_New();
-		if (!output)
-			break;
+	self->busy = 1;
 
-		while (size) {
-			key = _deserialize(b, 1);
-			if (!key)
-				break;
-			value = _deserialize(b, 0);
-			if (!value) {
-				Py_DECREF(key);
-				break;
-			}
-			result = PyDict_SetItem(output, key, value);
-			Py_DECREF(value);
-			Py_DECREF(key);
-			if (result)
-				break;
+	if (self->state == STEP_START)
+		result = _step_encoder_start(self);
+	else
+		result = _step_encoder_verify(self);
+	if (!result) {
+		_step_begin(b, budget, seconds);
+		result = _encode_run(b, &self->stack);
+	}
+	if (!result)
+		result = _finish_message(b, 0);
 
-			size--;
-		}
-		if (size > 0) {
-			Py_DECREF(output);
-			output = NULL;
-		}
-		break;
-	case TYPE_TUPLE:
-		size = _get_size(b);
-		if (0 > size)
-			break;
+	self->busy = 0;
 
-		output = PyTuple_New(size);
-		if (!output)
-			break;
+	if (result == -EAGAIN)
+		return PyBool_FromLong(0);
+
+	if (!result) {
+		self->output = PyString_FromStringAndSize(b->buf, b->off);
+		if (!self->output)
+			result = -ENOMEM;
+	}
+
+	_step_encoder_release(self);
+
+	if (result) {
+		self->state = STEP_FAILED;
+		return NULL;
+	}
+
+	self->state = STEP_DONE;
+	return PyBool_FromLong(1);
+}
+
+static PyObject *step_encoder_load_symbols
+(
+	StepEncoderObject *self,
+	PyObject *args
+)
+{
+	if (self->busy || self->state != STEP_START) {
+		PyErr_SetString(PyExc_RuntimeError, "encoder already started");
+		return NULL;
+	}
+
+	return _symbols_load(&self->opts, args);
+}
+
+static PyObject *step_encoder_symbols(StepEncoderObject *self, void *closure)
+{
+	return _symbols_version(&self->opts);
+}
+
+static PyObject *step_encoder_done(StepEncoderObject *self, void *closure)
+{
+	return PyBool_FromLong(self->state == STEP_DONE);
+}
+
+static PyObject *step_encoder_offset(StepEncoderObject *self, void *closure)
+{
+	if (self->output)
+		return PyInt_FromSsize_t(PyString_GET_SIZE(self->output));
+
+	return PyInt_FromLong(self->buffer.off);
+}
+
+static PyObject *step_encoder_result(StepEncoderObject *self, void *closure)
+{
+	return _step_result(self->output, self->state);
+}
+
+static PyMethodDef step_encoder_methods[] = {
+	{"step", (PyCFunction)step_encoder_step, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("step([budget][, seconds]) -> bool\n\nEncode until about "
+		   "budget bytes (default 64K, 0 for no limit) have\nbeen "
+		   "produced or seconds (default none) have passed, whichever "
+		   "is\nfirst. Returns True once the message is complete.\n")},
+	{"load_symbols", (PyCFunction)step_encoder_load_symbols, METH_VARARGS,
+	 PyDoc_STR("load_symbols(version, names) -> None\n\nLoad a shared "
+		   "table of dict key names, before the first step.\n")},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef step_encoder_getset[] = {
+	{"done", (getter)step_encoder_done, NULL,
+	 PyDoc_STR("whether the message is complete"), NULL},
+	{"offset", (getter)step_encoder_offset, NULL,
+	 PyDoc_STR("bytes of the message encoded so far"), NULL},
+	{"result", (getter)step_encoder_result, NULL,
+	 PyDoc_STR("the encoded string, once done"), NULL},
+	{"symbols", (getter)step_encoder_symbols, NULL,
+	 PyDoc_STR("version of the loaded symbol table, or None"), NULL},
+	{NULL}
+};
+
+PyDoc_STRVAR(step_encoder_documentation,
+	     "StepEncoder(object[, **options])\n\n"
+	     "Encoder for one object which works in steps, for use from an "
+	     "event\nloop. Each step() encodes a slice of the object and "
+	     "returns, keeping\nits progress; compression and checksum are "
+	     "applied in the last step.\nThe object must not be modified "
+	     "until done, a list, dict or set found\nchanged in size fails "
+	     "the encode.\n");
+
+static PyTypeObject StepEncoderType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.StepEncoder",			/* tp_name */
+	sizeof(StepEncoderObject),		/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)step_encoder_dealloc,	/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	0,					/* tp_repr */
+	0,					/* tp_as_number */
+	0,					/* tp_as_sequence */
+	0,					/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+	step_encoder_documentation,		/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	step_encoder_methods,			/* tp_methods */
+	0,					/* tp_members */
+	step_encoder_getset,			/* tp_getset */
+	0,					/* tp_base */
+	0,					/* tp_dict */
+	0,					/* tp_descr_get */
+	0,					/* tp_descr_set */
+	0,					/* tp_dictoffset */
+	(initproc)step_encoder_init,		/* tp_init */
+	0,					/* tp_alloc */
+	PyType_GenericNew,			/* tp_new */
+};
+
+/*
+ * View objects. Proxies onto an encoded list, tuple or dict which
+ * locate and decode elements only when they are accessed. Nested
+ * containers are returned as views themselves, decoded elements are
+ * cached.
+ */
+typedef struct {
+	PyObject_HEAD
+	PyObject   *owner;	/* object exporting the encoded data */
+	Py_buffer   data;
+	int         type;	/* TYPE_LIST, TYPE_TUPLE or TYPE_DICT */
+	int         format;	/* format flags of the payload */
+	int         head;	/* offset of the container type tag */
+	int         first;	/* offset of the first element */
+	int         table;	/* offset of the element offset table, or -1 */
+	int         count;	/* elements, or pairs for a dict */
+	int         items;	/* encoded values, 2 * count for a dict */
+	int         known;	/* item offsets located so far */
+	int        *offsets;	/* item offsets, items + 1 */
+	PyObject  **cache;	/* decoded elements/values */
+	PyObject   *keys;	/* dict keys, in encoded order */
+	PyObject   *index;	/* dict key to pair position */
+	struct scan_state scan;
+} ViewObject;
+
+static PyTypeObject ListViewType;
+static PyTypeObject DictViewType;
+
+static PyObject *_view_new
+(
+	PyObject *owner,
+	Py_buffer *data,
+	int head,
+	int format
+)
+{
+	struct serial_buffer buffer;
+	ViewObject *view;
+	PyTypeObject *kind;
+	long long arg;
+	int first;
+	int count;
+	int table;
+	int type;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.buf    = data->buf;
+	buffer.len    = data->len;
+	buffer.off    = head;
+	buffer.format = format;
+	/*
+	 * every element takes at least a type tag, a count the data
+	 * could not possibly hold is rejected.
+	 */
+	type = _get_type(&buffer, &arg);
+	if (0 > type)
+		return NULL;
+
+	count = _get_len(&buffer, arg);
+	if (0 > count)
+		return NULL;
+
+	first = buffer.off;
+	table = -1;
+	/*
+	 * indexed payloads, step over the container length. elements of
+	 * a list/tuple with an offset table are located directly.
+	 */
+	if (format & FORMAT_INDEXED) {
+		first += sizeof(uint32_t);
 
-		for (i = 0; i < size; i++) {
-			value = _deserialize(b, 0);
-			if (!value)
-				break;
-			result = PyTuple_SetItem(output, i, value);
-			if (result)
-				/*
-				 * SetItem decrements value refcnt on error
-				 * and does not increase it on success.
-				 */
-				break;
+		if (type != TYPE_DICT && count >= INDEX_TABLE_MIN) {
+			table  = first;
+			first += count * sizeof(uint32_t);
 		}
 
-		if (size > i) {
-			Py_DECREF(output);
-			output = NULL;
+		if (first > data->len) {
+			PyErr_Format(PyExc_SystemError,
+				     "insufficient data at <%d> of <%zd>",
+				     head, data->len);
+			return NULL;
 		}
-		break;
-	case TYPE_NULL:
-		Py_INCREF(Py_None);
-		output = Py_None;
-		break;
-	case TYPE_PICKLE:
-		output = _deserialize_object(b);
-		break;
-	default:
-		sprintf(error_str, "Unhandled type: <%d>", type);
-		PyErr_SetString(PyExc_TypeError, error_str);
-		break;
 	}
 
-	return output;
+	kind = (type == TYPE_DICT) ? &DictViewType : &ListViewType;
+
+	view = PyObject_New(ViewObject, kind);
+	if (!view)
+		return NULL;
+
+	view->owner   = NULL;
+	view->type    = type;
+	view->format  = format;
+	view->head    = head;
+	view->first   = first;
+	view->table   = table;
+	view->count   = count;
+	view->items   = (type == TYPE_DICT) ? count * 2 : count;
+	view->known   = 0;
+	view->offsets = NULL;
+	view->cache   = NULL;
+	view->keys    = NULL;
+	view->index   = NULL;
+	memset(&view->scan, 0, sizeof(view->scan));
+	memset(&view->data, 0, sizeof(view->data));
+
+	if (_get_buffer(owner, &view->data, 0)) {
+		Py_DECREF(view);
+		return NULL;
+	}
+
+	Py_INCREF(owner);
+	view->owner = owner;
+	return (PyObject *)view;
 }
 
-static int _check_size(struct serial_buffer *buffer, int size)
+static void view_dealloc(ViewObject *self)
 {
-	char *new;
+	int i;
 
-	while ((buffer->len - buffer->off) < (size + sizeof(uint16_t))) {
-		new = realloc(buffer->buf, (buffer->len * 2));
-		if (!new) {
-			PyErr_Format(PyExc_MemoryError,
-				     "failed to reallocate buffer to <%d>",
-				     buffer->len * 2);
-			return -ENOMEM;
-		}
+	if (self->cache) {
+		for (i = 0; i < self->items; i++)
+			Py_XDECREF(self->cache[i]);
+		free(self->cache);
+	}
 
-		buffer->buf = new;
-		buffer->len = buffer->len * 2;
+	Py_XDECREF(self->keys);
+	Py_XDECREF(self->index);
+	_scan_free(&self->scan);
+	free(self->offsets);
+
+	if (self->owner) {
+		PyBuffer_Release(&self->data);
+		Py_DECREF(self->owner);
 	}
 
-	return 0;
+	PyObject_Del(self);
 }
 
-static int _copy_string
+/*
+ * decode the value at offset. containers become views, everything
+ * else is decoded in full.
+ */
+static PyObject *_view_value
 (
-	struct serial_buffer *b,
-	const char *input_string,
-	int input_size,
-	short type
+	PyObject *owner,
+	Py_buffer *data,
+	int off,
+	int intern,
+	int format
 )
 {
-	int result;
+	struct serial_buffer buffer;
+	PyObject *output;
+	long long arg;
+	int type;
 
-	result = _check_size(b, input_size + sizeof(uint32_t));
-	if (result)
-		return result;
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.buf  = data->buf;
+	buffer.len  = data->len;
+	buffer.off    = off;
+	buffer.opts   = &default_options;
+	buffer.keys   = &default_keys;
+	buffer.owner  = owner;
+	buffer.format = format;
+
+	type = _get_type(&buffer, &arg);
+	if (!intern && !(format & FORMAT_REFS) &&
+	    (type == TYPE_LIST || type == TYPE_TUPLE || type == TYPE_DICT))
+		return _view_new(owner, data, off, format);
+	/*
+	 * anything else, malformed data included, is left to the decoder.
+	 * so are dict keys, which must hash and compare by value, and
+	 * messages using back references, which are decoded whole.
+	 */
+	if (0 > type)
+		PyErr_Clear();
 
-	*(uint16_t *)(b->buf + b->off) = htons(type);
-	b->off += sizeof(uint16_t);
-	*(uint32_t *)(b->buf + b->off) = htonl(input_size);
-	b->off += sizeof(uint32_t);
+	buffer.off = off;
+	output = _deserialize_body(&buffer, intern);
+	if (!output)
+		_deserialize_error(&buffer);
 
-	memcpy((b->buf + b->off), input_string, input_size);
-	b->off += input_size;
-	return 0;
+	return output;
 }
 
-static int _check_whitelist(PyObject *input)
+/*
+ * find the offset of item i, skipping over any items in between which
+ * have not been located yet.
+ */
+static int _view_locate(ViewObject *self, int i)
 {
-	struct whitelist_entry *entry;
+	const char *buf = self->data.buf;
+	int result;
+	int off;
 
-	if (!wls_on)
-		return 0;
+	if (!self->offsets) {
+		self->offsets = malloc(sizeof(int) * (self->items + 1));
+		self->cache   = calloc(MAX(self->items, 1), sizeof(PyObject *));
+		if (!self->offsets || !self->cache) {
+			PyErr_NoMemory();
+			return -ENOMEM;
+		}
 
-	for (entry = whitelist; entry->cls; entry++) {
-		if (PyObject_IsInstance(input, entry->cls))
-			return 0;
+		self->offsets[0] = self->first;
+		self->known = 1;
 	}
 
-	return -EINVAL;
-}
-
-static int _serialize_object(PyObject *input, struct serial_buffer *b, int dp)
-{
-	char error_str[128];
-	PyObject *dumps;
-	PyObject *value;
-	int result = 0;
-
-	if (_check_whitelist(input)) {
-		sprintf(error_str, "Unlisted type: <%s>",
-			input->ob_type->tp_name);
-		PyErr_SetString(PyExc_TypeError, error_str);
+	if (0 <= self->table) {
+		off = self->offsets[0] +
+			_load_u32(buf + self->table + i * sizeof(uint32_t),
+				  self->format);
+		if (off >= self->data.len || off < self->offsets[0]) {
+			PyErr_Format(PyExc_SystemError,
+				     "element offset <%d> outside <%zd>",
+				     off, self->data.len);
+			return -EINVAL;
+		}
 
-		result = -EINVAL;
-		goto err_dump;
+		return off;
 	}
 
-	dumps = PyObject_GetAttr(cpick, cpdumps_str);
-	if (!dumps) {
-		result = -EINVAL;
-		goto err_dump;
-	}
+	while (self->known <= i) {
+		self->scan.pos    = self->offsets[self->known - 1];
+		self->scan.body   = 1;
+		self->scan.format = self->format;
+		self->scan.depth  = 0;
+
+		result = _scan(&self->scan, buf, self->data.len,
+			       default_options.max_depth);
+		if (!result)
+			PyErr_Format(PyExc_SystemError,
+				     "insufficient data at <%d> of <%zd>",
+				     self->scan.pos, self->data.len);
+		if (result <= 0)
+			return -EINVAL;
 
-	value = PyObject_CallFunction(dumps, "O", input);
-	if (!value) {
-		result = -EINVAL;
-		goto err_call;
+		self->offsets[self->known++] = self->scan.pos;
 	}
 
-	result = _copy_string(b,
-			      PyString_AS_STRING(value),
-			      PyString_GET_SIZE(value),
-			      TYPE_PICKLE);
-
-	Py_DECREF(value);
-err_call:
-	Py_DECREF(dumps);
-err_dump:
-	return result;
+	return self->offsets[i];
 }
 
-static int _serialize(PyObject *input, struct serial_buffer *b, int dp)
+static PyObject *_view_item(ViewObject *self, int i)
 {
-	char error_str[128];
 	PyObject *value;
-	PyObject *key;
-	long i;
-	long long item;
-	int result;
+	int off;
 
-	if (max_depth < dp++) {
-		PyErr_Format(PyExc_SystemError, 
-			     "max recursion depth <%d> exceeded", max_depth);
-		return -EINVAL;
-	}
+	off = _view_locate(self, i);
+	if (0 > off)
+		return NULL;
 
-	if (!input) {
-		PyErr_SetString(PyExc_SystemError, "missing input object");
-		return -EINVAL;
-	}
-	if (!b) {
-		PyErr_SetString(PyExc_SystemError, "missing buffer object");
-		return -EINVAL;
-	}
+	if (!self->cache[i]) {
+		value = _view_value(self->owner, &self->data, off,
+				    self->type == TYPE_DICT && !(i & 1),
+				    self->format);
+		if (!value)
+			return NULL;
 
-	if (b->func) {
-		result = _check_yield(b);
-		if (result)
-			return result;
+		self->cache[i] = value;
 	}
 
-	if (PyInt_Check(input)) {
-		item = PyInt_AS_LONG(input);
+	Py_INCREF(self->cache[i]);
+	return self->cache[i];
+}
 
-		if (item > INT_MAX || item < INT_MIN) {
-			result = _check_size(b, sizeof(uint64_t));
-			if (result)
-				return result;
+static int _view_index(ViewObject *self)
+{
+	PyObject *position;
+	PyObject *key;
+	int result;
+	int i;
 
-			*(uint16_t *)(b->buf + b->off) = htons(TYPE_LONG);
-			b->off += sizeof(uint16_t);
-			*(uint64_t *)(b->buf + b->off) = htonll(item);
-			b->off += sizeof(uint64_t);
+	if (self->index)
+		return 0;
 
-			goto done;
-		}
-		else {
-			result = _check_size(b, sizeof(uint32_t));
-			if (result)
-				return result;
+	self->keys  = PyList_New(self->count);
+	self->index = PyDict_New();
+	if (!self->keys || !self->index)
+		goto error;
 
-			*(uint16_t *)(b->buf + b->off) = htons(TYPE_INT);
-			b->off += sizeof(uint16_t);
-			*(uint32_t *)(b->buf + b->off) = htonl(item);
-			b->off += sizeof(uint32_t);
+	for (i = 0; i < self->count; i++) {
+		key = _view_item(self, i * 2);
+		if (!key)
+			goto error;
 
-			goto done;
-		}
-	}
+		PyList_SET_ITEM(self->keys, i, key);
 
-	if (PyLong_Check(input)) {
-		item = PyLong_AsLongLong(input);
-		if (item == -1 && PyErr_Occurred()) {
-			PyErr_Clear();
+		position = PyInt_FromLong(i);
+		if (!position)
+			goto error;
 
-			i = _PyLong_NumBits(input) + 1; /* include sign bit */
-			i = i/8 + MIN(i%8, 1); /* byte count rounded up */
+		result = PyDict_SetItem(self->index, key, position);
+		Py_DECREF(position);
+		if (result)
+			goto error;
+	}
 
-			result = _check_size(b, sizeof(uint32_t) + i);
-			if (result)
-				return result;
+	return 0;
+error:
+	Py_CLEAR(self->keys);
+	Py_CLEAR(self->index);
+	return -EINVAL;
+}
 
-			*(uint16_t *)(b->buf + b->off) = htons(TYPE_LONGER);
-			b->off += sizeof(uint16_t);
-			*(uint32_t *)(b->buf + b->off) = htonl(i);
-			b->off += sizeof(uint32_t);
+static Py_ssize_t view_length(ViewObject *self)
+{
+	return self->count;
+}
 
-			result = _PyLong_AsByteArray(
-				(PyLongObject *)input,
-				(unsigned char *)(b->buf + b->off),
-				(size_t)i, 0, 1);
-			if (result)
-				return result;
+static PyObject *listview_item(ViewObject *self, Py_ssize_t i)
+{
+	if (i < 0 || i >= self->count) {
+		PyErr_SetString(PyExc_IndexError, "view index out of range");
+		return NULL;
+	}
 
-			b->off += i;
-			goto done;
-		}
-		else {
-			result = _check_size(b, sizeof(uint64_t));
-			if (result)
-				return result;
+	return _view_item(self, i);
+}
 
-			*(uint16_t *)(b->buf + b->off) = htons(TYPE_LONG);
-			b->off += sizeof(uint16_t);
-			*(uint64_t *)(b->buf + b->off) = htonll(item);
-			b->off += sizeof(uint64_t);
+static PyObject *listview_subscript(ViewObject *self, PyObject *item)
+{
+	Py_ssize_t start, stop, step, size, i, j;
+	PyObject *output;
+	PyObject *value;
 
-			goto done;
-		}
-	}
+	if (PyIndex_Check(item)) {
+		i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+		if (i == -1 && PyErr_Occurred())
+			return NULL;
+		if (i < 0)
+			i += self->count;
 
-	if (PyString_Check(input)) {
-		result = _copy_string(b,
-				      PyString_AS_STRING(input),
-				      PyString_GET_SIZE(input),
-				      TYPE_STRING);
-		if (result)
-			return result;
+		return listview_item(self, i);
+	}
 
-		goto done;
+	if (!PySlice_Check(item)) {
+		PyErr_Format(PyExc_TypeError,
+			     "view indices must be integers, not %.200s",
+			     item->ob_type->tp_name);
+		return NULL;
 	}
 
-	if (PyUnicode_Check(input)) {
-		value = PyUnicode_AsUTF8String(input);
-		if (!value)
-			return -EINVAL;
+	if (PySlice_GetIndicesEx((PySliceObject *)item, self->count,
+				 &start, &stop, &step, &size))
+		return NULL;
 
-		result = _copy_string(b,
-				      PyString_AS_STRING(value),
-				      PyString_GET_SIZE(value),
-				      utf8_support ? TYPE_UTF8 : TYPE_STRING);
-		Py_DECREF(value);
+	output = PyList_New(size);
+	if (!output)
+		return NULL;
 
-		if (result)
-			return result;
+	for (i = start, j = 0; j < size; i += step, j++) {
+		value = _view_item(self, i);
+		if (!value) {
+			Py_DECREF(output);
+			return NULL;
+		}
 
-		goto done;
+		PyList_SET_ITEM(output, j, value);
 	}
 
-	if (PyList_Check(input)) {
-		result = _check_size(b, sizeof(uint32_t));
-		if (result)
-			return result;
+	return output;
+}
 
-		*(uint16_t *)(b->buf + b->off) = htons(TYPE_LIST);
-		b->off += sizeof(uint16_t);
-		*(uint32_t *)(b->buf + b->off) = htonl(PyList_GET_SIZE(input));
-		b->off += sizeof(uint32_t);
+static PyObject *dictview_lookup(ViewObject *self, PyObject *key)
+{
+	PyObject *position;
 
-		for (i = 0; i < PyList_GET_SIZE(input); i++) {
-			result = _serialize(PyList_GET_ITEM(input, i), b, dp);
-			if (result)
-				return result;
-		}
+	if (_view_index(self))
+		return NULL;
 
-		goto done;
+	position = PyDict_GetItem(self->index, key);
+	if (!position) {
+		if (!PyErr_Occurred())
+			PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
 	}
 
-	if (PyDict_Check(input)) {
-		Py_ssize_t j = 0;
-
-		result = _check_size(b, sizeof(uint32_t));
-		if (result)
-			return result;
+	return _view_item(self, PyInt_AS_LONG(position) * 2 + 1);
+}
 
-		*(uint16_t *)(b->buf + b->off) = htons(TYPE_DICT);
-		b->off += sizeof(uint16_t);
-		*(uint32_t *)(b->buf + b->off) = htonl(PyDict_Size(input));
-		b->off += sizeof(uint32_t);
+static int dictview_contains(ViewObject *self, PyObject *key)
+{
+	if (_view_index(self))
+		return -1;
 
-		while (PyDict_Next(input, &j, &key, &value)) {
-			result = _serialize(key, b, dp);
-			if (result)
-				return result;
-			result = _serialize(value, b, dp);
-			if (result)
-				return result;
-		}
+	return PyDict_Contains(self->index, key);
+}
 
-		goto done;
-	}
+static PyObject *dictview_iter(ViewObject *self)
+{
+	if (_view_index(self))
+		return NULL;
 
-	if (Py_None == input) {
-		result = _check_size(b, 0);
-		if (result)
-			return result;
+	return PyObject_GetIter(self->keys);
+}
 
-		*(uint16_t *)(b->buf + b->off) = htons(TYPE_NULL);
-		b->off += sizeof(uint16_t);
+static PyObject *dictview_get(ViewObject *self, PyObject *args)
+{
+	PyObject *fallback = Py_None;
+	PyObject *output;
+	PyObject *key;
 
-		goto done;
-	}
+	if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &fallback))
+		return NULL;
 
-	if (PyFloat_Check(input)) {
-		result = _check_size(b, sizeof(double));
-		if (result)
-			return result;
+	output = dictview_lookup(self, key);
+	if (output || !PyErr_ExceptionMatches(PyExc_KeyError))
+		return output;
 
-		*(uint16_t *)(b->buf + b->off) = htons(TYPE_DOUBLE);
-		b->off += sizeof(uint16_t);
-		*(double *)(b->buf + b->off) = PyFloat_AS_DOUBLE(input);
-		b->off += sizeof(double);
+	PyErr_Clear();
+	Py_INCREF(fallback);
+	return fallback;
+}
 
-		goto done;
-	}
+static PyObject *dictview_keys(ViewObject *self, PyObject *noargs)
+{
+	if (_view_index(self))
+		return NULL;
 
-	if (PyTuple_Check(input)) {
-		result = _check_size(b, sizeof(uint32_t));
-		if (result)
-			return result;
+	return PyList_GetSlice(self->keys, 0, self->count);
+}
 
-		*(uint16_t *)(b->buf + b->off) = htons(TYPE_TUPLE);
-		b->off += sizeof(uint16_t);
-		*(uint32_t *)(b->buf + b->off) = htonl(PyTuple_GET_SIZE(input));
-		b->off += sizeof(uint32_t);
+static PyObject *_dictview_list(ViewObject *self, int pairs)
+{
+	PyObject *output;
+	PyObject *value;
+	int i;
 
-		for (i = 0; i < PyTuple_GET_SIZE(input); i++) {
-			result = _serialize(PyTuple_GET_ITEM(input, i), b, dp);
-			if (result)
-				return result;
-		}
+	if (_view_index(self))
+		return NULL;
 
-		goto done;
-	}
+	output = PyList_New(self->count);
+	if (!output)
+		return NULL;
 
-	if (cpick) {
-		result = _serialize_object(input, b, dp);
-		if (result)
-			return result;
+	for (i = 0; i < self->count; i++) {
+		value = _view_item(self, i * 2 + 1);
+		if (value && pairs)
+			value = Py_BuildValue("(ON)",
+					      PyList_GET_ITEM(self->keys, i),
+					      value);
+		if (!value) {
+			Py_DECREF(output);
+			return NULL;
+		}
 
-		goto done;
+		PyList_SET_ITEM(output, i, value);
 	}
 
-	sprintf(error_str, "Unhandled type: <%s>",
-		input->ob_type->tp_name);
-	PyErr_SetString(PyExc_TypeError, error_str);
-	return -EINVAL;
-done:
-	return 0;
+	return output;
 }
 
+static PyObject *dictview_values(ViewObject *self, PyObject *noargs)
+{
+	return _dictview_list(self, 0);
+}
 
+static PyObject *dictview_items(ViewObject *self, PyObject *noargs)
+{
+	return _dictview_list(self, 1);
+}
 
-static PyObject *py_serialize(PyObject *self, PyObject *args)
+static PyObject *view_materialize(ViewObject *self, PyObject *noargs)
 {
 	struct serial_buffer buffer;
-	PyObject *input;
 	PyObject *output;
-	PyObject *yield = NULL;
-	PyObject *yargs = empty_tuple;
-	int length = DEFAULT_MAX_RUN;
-	int result;
 
-	result = PyArg_ParseTuple(args, "O|OO!i", 
-				  &input, &yield,
-				  &PyTuple_Type, &yargs,
-				  &length);
-	if (!result)
-		return NULL;
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.buf  = self->data.buf;
+	buffer.len  = self->data.len;
+	buffer.off    = self->head;
+	buffer.opts   = &default_options;
+	buffer.keys   = &default_keys;
+	buffer.format = self->format;
 
-	if (yield && !PyCallable_Check(yield)) {
-		PyErr_Format(PyExc_TypeError,
-			     "'%s' object not callable",
-			     yield->ob_type->tp_name);
-		return NULL;
-	}
+	output = _deserialize(&buffer, 0);
+	if (!output)
+		_deserialize_error(&buffer);
 
-	buffer.len  = INIT_BUFFER_LEN;
-	buffer.off  = 0;
-	buffer.buf  = malloc(buffer.len);
-	buffer.func = yield;
-	buffer.size = length;
-	buffer.last = 0;
-	buffer.args = yargs;
+	return output;
+}
 
-	if (!buffer.buf) {
-		PyErr_Format(PyExc_MemoryError,
-			     "failed to allocate buffer <%d>", buffer.len);
-		return NULL;
-	}
+static PyObject *view_repr(ViewObject *self)
+{
+	return PyString_FromFormat("<%s of %d %s>", self->ob_type->tp_name,
+				   self->count,
+				   self->type == TYPE_DICT ? "pairs" : "items");
+}
 
-	result = _serialize(input, &buffer, 0);
-	if (result)
-		output = NULL;
-	else
-		output = PyString_FromStringAndSize(buffer.buf, buffer.off);
+static PySequenceMethods listview_as_sequence = {
+	(lenfunc)view_length,			/* sq_length */
+	0,					/* sq_concat */
+	0,					/* sq_repeat */
+	(ssizeargfunc)listview_item,		/* sq_item */
+};
 
-	free(buffer.buf);
-	return output;
-}
+static PyMappingMethods listview_as_mapping = {
+	(lenfunc)view_length,			/* mp_length */
+	(binaryfunc)listview_subscript,		/* mp_subscript */
+	0,					/* mp_ass_subscript */
+};
+
+static PySequenceMethods dictview_as_sequence = {
+	0,					/* sq_length */
+	0,					/* sq_concat */
+	0,					/* sq_repeat */
+	0,					/* sq_item */
+	0,					/* sq_slice */
+	0,					/* sq_ass_item */
+	0,					/* sq_ass_slice */
+	(objobjproc)dictview_contains,		/* sq_contains */
+};
+
+static PyMappingMethods dictview_as_mapping = {
+	(lenfunc)view_length,			/* mp_length */
+	(binaryfunc)dictview_lookup,		/* mp_subscript */
+	0,					/* mp_ass_subscript */
+};
+
+static PyMethodDef listview_methods[] = {
+	{"materialize", (PyCFunction)view_materialize, METH_NOARGS,
+	 PyDoc_STR("materialize() -> list or tuple\n\nDecode the whole "
+		   "container.\n")},
+	{NULL, NULL, 0, NULL}
+};
 
-static PyObject *py_deserialize(PyObject *self, PyObject *args)
+static PyMethodDef dictview_methods[] = {
+	{"get", (PyCFunction)dictview_get, METH_VARARGS,
+	 PyDoc_STR("get(key[, default]) -> value\n")},
+	{"keys", (PyCFunction)dictview_keys, METH_NOARGS,
+	 PyDoc_STR("keys() -> list\n")},
+	{"values", (PyCFunction)dictview_values, METH_NOARGS,
+	 PyDoc_STR("values() -> list\n")},
+	{"items", (PyCFunction)dictview_items, METH_NOARGS,
+	 PyDoc_STR("items() -> list\n")},
+	{"materialize", (PyCFunction)view_materialize, METH_NOARGS,
+	 PyDoc_STR("materialize() -> dict\n\nDecode the whole "
+		   "container.\n")},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ListViewType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.ListView",			/* tp_name */
+	sizeof(ViewObject),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)view_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	(reprfunc)view_repr,			/* tp_repr */
+	0,					/* tp_as_number */
+	&listview_as_sequence,			/* tp_as_sequence */
+	&listview_as_mapping,			/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	"Lazily decoded view of an encoded list or tuple.",	/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	0,					/* tp_iter */
+	0,					/* tp_iternext */
+	listview_methods,			/* tp_methods */
+};
+
+static PyTypeObject DictViewType = {
+	PyObject_HEAD_INIT(NULL)
+	0,					/* ob_size */
+	"wbin.DictView",			/* tp_name */
+	sizeof(ViewObject),			/* tp_basicsize */
+	0,					/* tp_itemsize */
+	(destructor)view_dealloc,		/* tp_dealloc */
+	0,					/* tp_print */
+	0,					/* tp_getattr */
+	0,					/* tp_setattr */
+	0,					/* tp_compare */
+	(reprfunc)view_repr,			/* tp_repr */
+	0,					/* tp_as_number */
+	&dictview_as_sequence,			/* tp_as_sequence */
+	&dictview_as_mapping,			/* tp_as_mapping */
+	0,					/* tp_hash */
+	0,					/* tp_call */
+	0,					/* tp_str */
+	0,					/* tp_getattro */
+	0,					/* tp_setattro */
+	0,					/* tp_as_buffer */
+	Py_TPFLAGS_DEFAULT,			/* tp_flags */
+	"Lazily decoded view of an encoded dict.",	/* tp_doc */
+	0,					/* tp_traverse */
+	0,					/* tp_clear */
+	0,					/* tp_richcompare */
+	0,					/* tp_weaklistoffset */
+	(getiterfunc)dictview_iter,		/* tp_iter */
+	0,					/* tp_iternext */
+	dictview_methods,			/* tp_methods */
+};
+
+static PyObject *py_view(PyObject *self, PyObject *args, PyObject *kwds)
 {
+	static char *kwlist[] = {"buffer", "offset", NULL};
 	struct serial_buffer buffer;
-	PyObject *output;
+	struct serial_buffer inner;
+	Py_ssize_t offset = 0;
+	Py_buffer data;
+	PyObject *output = NULL;
+	PyObject *raw = NULL;
 	PyObject *input;
-	PyObject *yield = NULL;
-	PyObject *yargs = empty_tuple;
-	int length = DEFAULT_MAX_RUN;
+	int format;
 	int result;
 
-	result = PyArg_ParseTuple(args, "O!|OO!i",
-				  &PyString_Type, (PyObject *)&input, &yield,
-				  &PyTuple_Type, &yargs,
-				  &length);
+	result = PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist,
+					     &input, &offset);
 	if (!result)
 		return NULL;
 
-	if (yield && !PyCallable_Check(yield)) {
-		PyErr_Format(PyExc_TypeError,
-			     "'%s' object not callable",
-			     yield->ob_type->tp_name);
+	if (_get_buffer(input, &data, 0))
 		return NULL;
-	}
 
-	buffer.len  = PyString_GET_SIZE(input);
-	buffer.off  = 0;
-	buffer.buf  = PyString_AS_STRING(input);
-	buffer.func = yield;
-	buffer.size = length;
-	buffer.last = 0;
-	buffer.args = yargs;
+	if (_check_offset(&data, offset) || _check_offset(&data, 0))
+		goto done;
 
-	output = _deserialize(&buffer, 0);
-	if (!output)
-		_deserialize_error(&buffer);
+	result = _get_header((char *)data.buf + offset, data.len - offset,
+			     &format);
+	if (result == -EAGAIN)
+		PyErr_SetString(PyExc_SystemError, "insufficient data");
+	if (0 > result)
+		goto done;
+	/*
+	 * views decode with the module options, which have no symbols.
+	 */
+	if (_check_frame((char *)data.buf + offset, data.len - offset, &format,
+			 default_options.checksum))
+		goto done;
+
+	if (_check_symbols(NULL, (char *)data.buf + offset, format))
+		goto done;
+	/*
+	 * views of a compressed message refer into its decompressed body.
+	 */
+	if (format & FORMAT_LZ) {
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.buf    = data.buf;
+		buffer.len    = data.len;
+		buffer.off    = offset + result;
+		buffer.opts   = &default_options;
+		buffer.keys   = &default_keys;
+		buffer.format = format;
+
+		raw = _inflate(&buffer, &inner);
+		if (!raw)
+			goto done;
+
+		PyBuffer_Release(&data);
+		if (_get_buffer(raw, &data, 0)) {
+			Py_DECREF(raw);
+			return NULL;
+		}
+
+		input  = raw;
+		offset = result = 0;
+		format = inner.format;
+	}
 
+	output = _view_value(input, &data, offset + result, 0, format);
+done:
+	PyBuffer_Release(&data);
+	Py_XDECREF(raw);
 	return output;
 }
 
 static PyObject *utf8_enable(PyObject *self, PyObject *noargs)
 {
-	utf8_support = 1;
+	default_options.utf8 = 1;
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
 static PyObject *utf8_disable(PyObject *self, PyObject *noargs)
 {
-	utf8_support = 0;
+	default_options.utf8 = 0;
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
 static PyObject *utf8_enabled(PyObject *self, PyObject *noargs)
 {
-	return PyBool_FromLong((long)utf8_support);
+	return PyBool_FromLong((long)default_options.utf8);
 }
 
 static PyObject *wls_enable(PyObject *self, PyObject *noargs)
 {
-	wls_on = 1;
+	default_options.wls = 1;
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
 static PyObject *wls_disable(PyObject *self, PyObject *noargs)
 {
-	wls_on = 0;
+	default_options.wls = 0;
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
 static PyObject *wls_enabled(PyObject *self, PyObject *noargs)
 {
-	return PyBool_FromLong((long)wls_on);
+	return PyBool_FromLong((long)default_options.wls);
+}
+static PyObject *register_type(PyObject *self, PyObject *args)
+{
+	PyObject *encode;
+	PyObject *decode;
+	PyObject *value;
+	PyObject *cls;
+	int tag;
+
+	if (!PyArg_ParseTuple(args, "OiOO", &cls, &tag, &encode, &decode))
+		return NULL;
+
+	if (!PyType_Check(cls)) {
+		PyErr_SetString(PyExc_TypeError, "cls must be a class");
+		return NULL;
+	}
+
+	if (0 > tag || tag > EXT_TAG_MAX) {
+		PyErr_Format(PyExc_ValueError,
+			     "tag must be between 0 and %d", EXT_TAG_MAX);
+		return NULL;
+	}
+
+	if (!PyCallable_Check(encode) || !PyCallable_Check(decode)) {
+		PyErr_SetString(PyExc_TypeError,
+				"encode and decode must be callable");
+		return NULL;
+	}
+	/*
+	 * a class, or a tag, registered again replaces the earlier
+	 * registration.
+	 */
+	value = PyDict_GetItem(ext_classes, cls);
+	if (value)
+		Py_CLEAR(ext_types[PyInt_AS_LONG(value)].cls);
+
+	if (ext_types[tag].cls &&
+	    PyDict_DelItem(ext_classes, ext_types[tag].cls))
+		return NULL;
+
+	value = PyInt_FromLong(tag);
+	if (!value)
+		return NULL;
+
+	if (PyDict_SetItem(ext_classes, cls, value)) {
+		Py_DECREF(value);
+		return NULL;
+	}
+	Py_DECREF(value);
+
+	Py_INCREF(cls);
+	Py_INCREF(encode);
+	Py_INCREF(decode);
+
+	Py_XDECREF(ext_types[tag].cls);
+	Py_XDECREF(ext_types[tag].encode);
+	Py_XDECREF(ext_types[tag].decode);
+
+	ext_types[tag].cls    = cls;
+	ext_types[tag].encode = encode;
+	ext_types[tag].decode = decode;
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static void _schema_rebuild(void)
+{
+	int i;
+
+	memset(schema_slots, 0, sizeof(schema_slots));
+
+	for (i = 0; i <= SCHEMA_ID_MAX; i++)
+		if (schemas[i].fields)
+			*_schema_slot(schemas[i].sign) = i + 1;
+}
+
+static PyObject *register_schema(PyObject *self, PyObject *args)
+{
+	struct schema_entry entry = {NULL, NULL, NULL, NULL, NULL, 0, 0};
+	struct schema_entry old;
+	PyObject *types = Py_None;
+	PyObject *cls = Py_None;
+	PyObject *fields;
+	PyObject *value;
+	PyObject *name;
+	PyObject *seq;
+	Py_ssize_t count;
+	Py_ssize_t i;
+	int *slot;
+	int result;
+	int id;
+
+	if (!PyArg_ParseTuple(args, "iO|OO", &id, &fields, &types, &cls))
+		return NULL;
+
+	if (0 > id || id > SCHEMA_ID_MAX) {
+		PyErr_Format(PyExc_ValueError,
+			     "id must be between 0 and %d", SCHEMA_ID_MAX);
+		return NULL;
+	}
+
+	if (Py_None != cls && !PyCallable_Check(cls)) {
+		PyErr_SetString(PyExc_TypeError, "cls must be callable");
+		return NULL;
+	}
+
+	seq = PySequence_Fast(fields, "fields must be a sequence");
+	if (!seq)
+		return NULL;
+
+	count = PySequence_Fast_GET_SIZE(seq);
+	if (!count) {
+		PyErr_SetString(PyExc_ValueError, "schema has no fields");
+		goto error;
+	}
+
+	entry.fields = PyTuple_New(count);
+	entry.index  = PyDict_New();
+	entry.order  = malloc(sizeof(int) * count);
+	if (!entry.fields || !entry.index || !entry.order) {
+		PyErr_NoMemory();
+		goto error;
+	}
+
+	for (i = 0; i < count; i++) {
+		name = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PyString_CheckExact(name)) {
+			PyErr_Format(PyExc_TypeError,
+				     "field <%zd> is not a str", i);
+			goto error;
+		}
+
+		Py_INCREF(name);
+		PyString_InternInPlace(&name);
+		PyTuple_SET_ITEM(entry.fields, i, name);
+
+		if (PyDict_GetItem(entry.index, name)) {
+			PyErr_Format(PyExc_ValueError, "duplicate field <%s>",
+				     PyString_AS_STRING(name));
+			goto error;
+		}
+
+		value = PyInt_FromSsize_t(i);
+		if (!value)
+			goto error;
+
+		result = PyDict_SetItem(entry.index, name, value);
+		Py_DECREF(value);
+		if (result)
+			goto error;
+
+		entry.order[i] = i;
+		entry.sign = _schema_sign(entry.sign, name);
+	}
+
+	entry.check = _schema_check(entry.fields);
+
+	if (Py_None != types) {
+		entry.types = PySequence_Tuple(types);
+		if (!entry.types)
+			goto error;
+
+		if (PyTuple_GET_SIZE(entry.types) != count) {
+			PyErr_SetString(PyExc_ValueError,
+					"types and fields differ in length");
+			goto error;
+		}
+
+		for (i = 0; i < count; i++) {
+			name = PyTuple_GET_ITEM(entry.types, i);
+			if (Py_None != name && !PyType_Check(name)) {
+				PyErr_Format(PyExc_TypeError,
+					     "type <%zd> is not a class", i);
+				goto error;
+			}
+		}
+	}
+	/*
+	 * an id registered again replaces the earlier schema, the same
+	 * fields under two ids would be ambiguous.
+	 */
+	slot = _schema_slot(entry.sign);
+	if (*slot && *slot - 1 != id) {
+		PyErr_Format(PyExc_ValueError,
+			     "fields already registered as schema <%d>",
+			     *slot - 1);
+		goto error;
+	}
+
+	if (Py_None != cls) {
+		Py_INCREF(cls);
+		entry.cls = cls;
+	}
+
+	Py_DECREF(seq);
+
+	old = schemas[id];
+	schemas[id] = entry;
+	if (!old.fields)
+		schema_count++;
+
+	_schema_rebuild();
+
+	Py_XDECREF(old.fields);
+	Py_XDECREF(old.types);
+	Py_XDECREF(old.cls);
+	Py_XDECREF(old.index);
+	free(old.order);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+error:
+	Py_XDECREF(entry.fields);
+	Py_XDECREF(entry.types);
+	Py_XDECREF(entry.index);
+	free(entry.order);
+	Py_DECREF(seq);
+	return NULL;
 }
+
 static PyObject *echo_maxint(PyObject *self, PyObject *noargs)
 {
 	return PyInt_FromLong(LONG_MAX);
@@ -934,8 +9510,9 @@ static PyObject *echo_minint(PyObject *self, PyObject *noargs)
 }
 
 static PyMethodDef _bin_methods[] = {
-	{"serialize", py_serialize, METH_VARARGS,
-	 PyDoc_STR("serialize(object[, callback[, args[, frequency]]]) -> "
+	{"serialize", (PyCFunction)py_serialize, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("serialize(object[, callback[, args[, frequency[, exact]]]])"
+		   " -> "
 		   "string.\n\nGiven  a python object  encode it  into a  "
 		   "python string.  An optional\ncallback(offset[,args])  "
 		   "will be  periodically called  with  number of\nbytes so"
@@ -944,10 +9521,15 @@ static PyMethodDef _bin_methods[] = {
 		   "an optional args parameter\nto  the serialize  function."
 		   " Finally  an optional  frequency parameter\ndetermines "
 		   "approximately how many  bytes are encoded between each "
-		   "call\nto the callback function. (default 8K)\n")},
-	{"deserialize", py_deserialize, METH_VARARGS,
-	 PyDoc_STR("deserialize(object[, callback[, args[, frequency]]]) -> "
-		   "string.\n\nGiven  a python string  decode it  into a  "
+		   "call\nto the callback function. (default 8K)\n\n"
+		   "When exact is true a sizing pass is run first and the "
+		   "object is\nencoded directly into a string of exactly "
+		   "encoded_size(object)\nbytes, avoiding buffer growth and "
+		   "the final copy.\n")},
+	{"deserialize", (PyCFunction)py_deserialize,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("deserialize(object[, callback[, args[, frequency[, select"
+		   "[, default]]]]]) -> object.\n\nGiven  a python string  decode it  into a  "
 		   "python object.  An optional\ncallback(offset[,args])  "
 		   "will be  periodically called  with  number of\nbytes so"
 		   "far encoded as  the first parameter. The  remaining "
@@ -955,7 +9537,54 @@ static PyMethodDef _bin_methods[] = {
 		   "an optional args parameter\nto  the serialize  function."
 		   " Finally  an optional  frequency parameter\ndetermines "
 		   "approximately how many  bytes are encoded between each "
-		   "call\nto the callback function. (default 8K)\n")},
+		   "call\nto the callback function. (default 8K)\n\n"
+		   "When select, a sequence of key paths such as "
+		   "[('user', 'id'),\n('items', 0, 'price')], is given only "
+		   "the values at those paths\nare decoded and returned as a "
+		   "tuple in the same order, everything\nelse is skipped "
+		   "w/o being decoded. Missing paths are returned as\n"
+		   "default (None).\n")},
+	{"serialize_into", (PyCFunction)py_serialize_into,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("serialize_into(object, buffer[, offset]) -> int\n\n"
+		   "Encode object directly into a writable buffer (bytearray, "
+		   "mmap,\narray, ...) starting at offset, and return the "
+		   "number of bytes\nwritten. If the buffer is too small "
+		   "BufferError is raised with the\nnumber of bytes required "
+		   "as its second argument.\n")},
+	{"deserialize_from", (PyCFunction)py_deserialize_from,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("deserialize_from(buffer[, offset]) -> (object, offset)"
+		   "\n\nDecode one object from any readable buffer (str, "
+		   "bytearray,\nmemoryview, mmap, ...) starting at offset. "
+		   "Returns the object and\nthe offset of the first byte "
+		   "following its encoding, so that\nconsecutive objects "
+		   "can be decoded from one buffer without copies.\n")},
+	{"view", (PyCFunction)py_view, METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("view(buffer[, offset]) -> view or object\n\nLazily "
+		   "decode the object encoded in buffer at offset. An "
+		   "encoded\nlist or tuple is returned as a ListView, a dict "
+		   "as a DictView. These\nlocate and decode elements only "
+		   "when accessed, caching the result,\nand return nested "
+		   "containers as views in turn. Other objects are\n"
+		   "decoded directly. Views hold a reference to buffer.\n")},
+	{"encoded_size", py_encoded_size, METH_VARARGS,
+	 PyDoc_STR("encoded_size(object) -> int\n\nReturns the exact number "
+		   "of bytes serialize(object) will produce,\nwithout "
+		   "producing it.\n")},
+	{"serialize_many", py_serialize_many, METH_VARARGS,
+	 PyDoc_STR("serialize_many(objects) -> (string, offsets)\n\nEncode "
+		   "each object of a sequence as a message of its own, all "
+		   "into\none string, in a single call. offsets is a tuple of "
+		   "the offset at\nwhich each message starts, message i "
+		   "ends where i + 1 starts.\n")},
+	{"deserialize_many", (PyCFunction)py_deserialize_many,
+	 METH_VARARGS | METH_KEYWORDS,
+	 PyDoc_STR("deserialize_many(buffer[, offsets]) -> list\n\nDecode "
+		   "the messages starting at each of offsets in a readable\n"
+		   "buffer, as produced by serialize_many(), in a single "
+		   "call. W/o\noffsets the buffer is decoded as consecutive "
+		   "messages up to its end.\n")},
 	{"utf8_enable",  utf8_enable,  METH_NOARGS,
 	 "utf8_enable() -> None\n\nEnable UTF8 encoding support\n"},
 	{"utf8_disable", utf8_disable, METH_NOARGS,
@@ -968,6 +9597,22 @@ static PyMethodDef _bin_methods[] = {
 	 "wls_off() -> None\n\nDisable encodable object whitelist (attempt to encode all objects)\n"},
 	{"wls_status", wls_enabled, METH_NOARGS,
 	 "wls_status() -> status\n\nReturns encodable object whitelist status\n"},
+	{"register_type", register_type, METH_VARARGS,
+	 "register_type(cls, tag, encode, decode) -> None\n\nEncode instances "
+	 "of cls, and its subclasses, as extension tag\n(0-255) followed by "
+	 "encode(instance), which must return a natively\nencodable value. "
+	 "Such values are decoded as decode(value). Registered\nclasses "
+	 "bypass the whitelist and are never pickled. Classes encoded\n"
+	 "natively (subclasses of dict, list, ...) are not affected.\n"},
+	{"register_schema", register_schema, METH_VARARGS,
+	 "register_schema(id, fields[, types[, cls]]) -> None\n\nRegister "
+	 "a record schema (0-255), a sequence of str field names.\nWith the "
+	 "schemas option a dict with exactly these keys, and values\nof the "
+	 "given types (a sequence of classes or None for any), is\nencoded "
+	 "as the schema id followed by its values in field order.\nRecords "
+	 "decode to a dict, or to cls(*values) if cls is given, and\nare "
+	 "refused if the id is registered with other fields. With refs\n"
+	 "a cls record cannot contain a reference to itself.\n"},
 	{"min_int", echo_minint, METH_NOARGS,
 	 "min_int() -> int\n\nReturns smallest integer that can be encoded\n"},
 	{"max_int", echo_maxint, METH_NOARGS,
@@ -981,15 +9626,66 @@ static PyMethodDef _bin_methods[] = {
 PyMODINIT_FUNC initwbin(void)
 {
 	struct whitelist_entry *entry;
+	PyObject *module;
 	PyObject *name;
 
-	(void)Py_InitModule3("wbin", _bin_methods, wbin_module_documentation);
+	module = Py_InitModule3("wbin", _bin_methods,
+				wbin_module_documentation);
+	if (!module)
+		return;
+
+	if (PyType_Ready(&CodecType) < 0)
+		return;
+
+	Py_INCREF(&CodecType);
+	PyModule_AddObject(module, "Codec", (PyObject *)&CodecType);
+
+	if (PyType_Ready(&DecoderType) < 0)
+		return;
+
+	Py_INCREF(&DecoderType);
+	PyModule_AddObject(module, "Decoder", (PyObject *)&DecoderType);
+
+	if (PyType_Ready(&EncoderType) < 0)
+		return;
+
+	Py_INCREF(&EncoderType);
+	PyModule_AddObject(module, "Encoder", (PyObject *)&EncoderType);
+
+	if (PyType_Ready(&StepDecoderType) < 0)
+		return;
+
+	Py_INCREF(&StepDecoderType);
+	PyModule_AddObject(module, "StepDecoder",
+			   (PyObject *)&StepDecoderType);
+
+	if (PyType_Ready(&StepEncoderType) < 0)
+		return;
+
+	Py_INCREF(&StepEncoderType);
+	PyModule_AddObject(module, "StepEncoder",
+			   (PyObject *)&StepEncoderType);
+
+	if (PyType_Ready(&ListViewType) < 0)
+		return;
+
+	Py_INCREF(&ListViewType);
+	PyModule_AddObject(module, "ListView", (PyObject *)&ListViewType);
+
+	if (PyType_Ready(&DictViewType) < 0)
+		return;
+
+	Py_INCREF(&DictViewType);
+	PyModule_AddObject(module, "DictView", (PyObject *)&DictViewType);
 	/*
 	 * empty tuple for default arguments to yield function
 	 */
 	empty_tuple = PyTuple_New(0);
 	if (!empty_tuple)
 		return;
+
+	if (_key_cache_init(&default_keys, DEFAULT_KEY_CACHE))
+		return;
 	/* 
 	 * attempt an import of cPickle which, if available, can be used
 	 * as a fallback for complex objects. error is not checked here,
@@ -1000,6 +9696,42 @@ PyMODINIT_FUNC initwbin(void)
 	INIT_STR(cpdumps_str, "dumps");
 
 	cpick = PyImport_Import(cpickle_str);
+	if (cpick) {
+		cploads = PyObject_GetAttr(cpick, cploads_str);
+		cpdumps = PyObject_GetAttr(cpick, cpdumps_str);
+	}
+	if (!cploads || !cpdumps)
+		PyErr_Clear();
+	/*
+	 * datetime and decimal are likewise only encoded natively if they
+	 * import.
+	 */
+	PyDateTime_IMPORT;
+	if (!PyDateTimeAPI)
+		PyErr_Clear();
+
+	_crc32c_init();
+
+	name = PyImport_ImportModule("decimal");
+	if (name) {
+		decimal_type = PyObject_GetAttrString(name, "Decimal");
+		Py_DECREF(name);
+	}
+	if (!decimal_type)
+		PyErr_Clear();
+
+	ext_classes = PyDict_New();
+	if (!ext_classes)
+		return;
+	/*
+	 * numpy is optional, ndarrays are only encoded natively (and can
+	 * only be decoded) if it imports.
+	 */
+	numpy = PyImport_ImportModule("numpy");
+	if (numpy)
+		ndarray_type = PyObject_GetAttrString(numpy, "ndarray");
+	if (!ndarray_type)
+		PyErr_Clear();
 	/*
 	 * import classes for cpickle white list.
 	 */